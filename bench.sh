@@ -0,0 +1,33 @@
+#!/bin/bash
+# インタプリタとネイティブの実行速度を比べる
+# インタプリタが実行したバイトコード命令数を仕事量とし、
+# 同じ仕事量をネイティブが何秒で終えるかを命令/秒に換算して並べる
+bench(){
+    name="$1"
+    input="$2"
+
+    ./compiler "$input" > tmp.s
+    cc -o tmp tmp.s 2>/dev/null
+    start=$(date +%s.%N)
+    ./tmp
+    expected="$?"
+    end=$(date +%s.%N)
+
+    stats=$(./compiler --interp --stats "$input" 2>&1 >/dev/null | grep executed; exit ${PIPESTATUS[0]})
+    if [ "$?" != "$expected" ]; then
+        echo "$name: --interp result differs from native"
+        exit 1
+    fi
+    count=$(echo "$stats" | awk '{print $2}')
+    interp=$(echo "$stats" | awk '{print $4}')
+
+    awk -v n="$name" -v c="$count" -v i="$interp" -v s="$start" -v e="$end" 'BEGIN {
+        t = e - s
+        printf "%-8s insns: %d  interp: %.3fs (%.1f Minsn/s)  native: %.3fs (%.1f Minsn/s)  ratio: %.1fx\n",
+               n, c, i, c / i / 1e6, t, c / t / 1e6, i / t
+    }'
+}
+
+bench sum "s=0; for(i=0; i<100000000; i=i+1) s=s+i; return s;"
+bench while "n=0; c=0; while(n<50000000){ if(n/3*3==n) c=c+1; n=n+1; } return c;"
+bench array "int a[1000]; int b[1000]; s=0; for(k=0; k<20000; k=k+1){ for(i=0; i<1000; i=i+1) a[i]=b[i]+k; s=s+a[999]; } return s;"
@@ -1,106 +1,205 @@
 #include "compiler.h"
 
+// 構文木をたどるのに再帰を使わず、やることを明示的なスタックに積んでいく
+// (深く入れ子になった式でもCのスタックを使い切らない)
+// 子の生成を積むときは、後から実行したいものから順に積む
+
+typedef enum {
+    T_GEN, // nodeの値を積む
+    T_LVAL, // nodeのアドレスを積む
+    T_LOAD, // スタックトップのアドレスから node->ty の値を読む
+    T_STORE, // 代入
+    T_RETURN,
+    T_BINARY, // 二項演算
+    T_POP, // 文の値を捨てる
+    T_PUSH0, // 値を持たない文の代わりに0を積む
+    T_BLOCK, // 複文の node 以降の文
+    T_IF_COND, // 条件が偽なら .Lelse へ
+    T_IF_NCOND, // 条件が真なら .Lelse へ(then節を後ろに置くとき)
+    T_IF_ELSE, // then節の終わりと .Lelse
+    T_BEGIN, // .Lbegin
+    T_COND, // 条件が偽なら .Lend へ
+    T_LOOP_END, // .Lbegin へ戻り、.Lend
+    T_END, // .Lend
+    T_VEC, // ベクトル化したループ本体
+    T_DISPATCH // switchの条件の値で各caseへ飛ぶ
+} TaskKind;
+
+typedef struct {
+    TaskKind kind;
+    Node* node;
+    int label;
+} Task;
+
 int label_num = 0;
+int debug_info = 0; // -g: 行番号の表とラベルのシンボルを出す(命令は変えない)
 
-void gen_lval(Node* node){
-    if (node->kind != ND_LVAR){
-        error("not a lvalue\n");
+// ラベルを置く(fmt は .L を除いた名前)
+// -g のときは main.begin3 のような局所シンボルも同じ位置に置き、perf や addr2line で見えるようにする
+void gen_label(char* fmt, ...){
+    char name[64];
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(name, sizeof(name), fmt, ap);
+    va_end(ap);
+
+    printf(".L%s:\n", name);
+    if (debug_info){
+        printf("main.%s:\n", name);
     }
-    printf("\tmov rax, rbp\n");
-    printf("\tsub rax, %d\n", node->offset);
-    printf("\tpush rax\n");
-    return;
 }
 
-void gen(Node* node){
-    // fprintf(stderr, "gen called(kind:%d)\n", node->kind);
-    if (node->kind == ND_NUM){
-        printf("\tpush %d\n", node->val);
-        return;
-    } else if (node->kind == ND_ASSIGN){
-        gen_lval(node->lhs);
-        gen(node->rhs);
-        printf("\tpop rdi\n");
-        printf("\tpop rax\n");
-        printf("\tmov [rax], rdi\n");
-        printf("\tpush rdi\n");
+int* line_starts; // 各行の先頭の user_input でのオフセット
+int line_count;
+int last_line;
+int last_col;
+
+// nodeのソース上の位置を .loc で示す(前と同じ位置なら出さない)
+void gen_loc(Node* node){
+    if (!debug_info || !node || !node->loc){
         return;
-    } else if (node->kind == ND_LVAR){
-        gen_lval(node);
-        printf("\tpop rax\n");
-        printf("\tmov rax, [rax]\n");
-        printf("\tpush rax\n");
+    }
+    if (!line_starts){
+        int cap = 16;
+        line_starts = (int*)malloc(sizeof(int) * cap);
+        line_starts[line_count++] = 0;
+        for (char* p = user_input; *p; p++){
+            if (*p != '\n'){
+                continue;
+            }
+            if (line_count == cap){
+                cap *= 2;
+                line_starts = (int*)realloc(line_starts, sizeof(int) * cap);
+            }
+            line_starts[line_count++] = p - user_input + 1;
+        }
+    }
+
+    // 位置より前で一番後ろの行頭を二分探索する
+    int pos = node->loc - user_input;
+    int lo = 0;
+    int hi = line_count - 1;
+    while (lo < hi){
+        int mid = (lo + hi + 1) / 2;
+        if (line_starts[mid] <= pos){
+            lo = mid;
+        } else {
+            hi = mid - 1;
+        }
+    }
+    int line = lo + 1;
+    int col = pos - line_starts[lo] + 1;
+    if (line == last_line && col == last_col){
         return;
-    } else if (node->kind == ND_RETURN){
-        gen(node->lhs);
-        printf("\tpop rax\n");
-        printf("\tmov rsp, rbp\n");
-        printf("\tpop rbp\n");
-        printf("\tret\n");
+    }
+    printf("\t.loc 1 %d %d\n", line, col);
+    last_line = line;
+    last_col = col;
+}
+
+// ここから先はソースのどの行にも当たらない(エピローグや、コンパイラが足した処理)
+// gas は行0の .loc を捨てるので、代わりに2番のファイル <generated> の1行目とする
+void gen_loc_none(){
+    if (!debug_info || last_line == -1){
         return;
-    } else if (node->kind == ND_IF){
-        int label = label_num;
-        label_num++;
+    }
+    printf("\t.loc 2 1\n");
+    last_line = -1;
+    last_col = 0;
+}
 
-        gen(node->lhs->lhs);
+// switchで連続した値のcaseをジャンプテーブルにする密度の下限(%)
+// 値の範囲のうちこの割合以上がcaseで埋まっていて、SWITCH_TABLE_MIN個以上あれば表にする
+int switch_density = 40;
+#define SWITCH_TABLE_MIN 4
 
-        if (!node->rhs){ // elseがない場合
-            printf("\tpop rax\n");
-            printf("\tcmp rax, 0\n");
-            printf("\tje .Lend%d\n", label);
-            gen(node->lhs->rhs);
-            printf(".Lend%d:\n", label);
+Task* tasks;
+int task_len;
+int task_cap;
+
+void push_task(TaskKind kind, Node* node, int label){
+    if (task_len == task_cap){
+        task_cap = task_cap ? task_cap * 2 : 256;
+        tasks = (Task*)realloc(tasks, sizeof(Task) * task_cap);
+    }
+    tasks[task_len].kind = kind;
+    tasks[task_len].node = node;
+    tasks[task_len].label = label;
+    task_len++;
+}
+
+// 文の生成を積む(NULLならelseのないifの偽の側で、代わりに0を積む)
+void push_stmt(Node* node, Node* parent){
+    if (node){
+        push_task(T_GEN, node, 0);
+    } else {
+        push_task(T_PUSH0, parent, 0);
+    }
+}
+
+// プロファイルでほとんど実行されないとわかったifの節
+// 関数の後ろに .Lelse から置き、値を1つ積んで .Lend へ戻る
+typedef struct {
+    Node* node;
+    Node* parent;
+    int label;
+} ColdBlock;
+
+ColdBlock* colds;
+int cold_len;
+int cold_cap;
+
+void push_cold(Node* node, Node* parent, int label){
+    if (cold_len == cold_cap){
+        cold_cap = cold_cap ? cold_cap * 2 : 16;
+        colds = (ColdBlock*)realloc(colds, sizeof(ColdBlock) * cold_cap);
+    }
+    colds[cold_len].node = node;
+    colds[cold_len].parent = parent;
+    colds[cold_len].label = label;
+    cold_len++;
+}
+
+// 追い出した節を生成する(その中でさらに追い出されたものも続けて並べる)
+void gen_cold_blocks(){
+    for (int i=0; i<cold_len; i++){
+        ColdBlock cold = colds[i];
+        gen_label("else%d", cold.label);
+        if (cold.node){
+            gen(cold.node);
         } else {
-            printf("\tpop rax\n");
-            printf("\tcmp rax, 0\n");
-            printf("\tje .Lelse%d\n", label);
-            gen(node->lhs->rhs);
-            printf("\tjmp .Lend%d\n", label);
-            printf(".Lelse%d:\n", label);
-            gen(node->rhs);
-            printf(".Lend%d:\n", label);
+            printf("\tpush 0\n");
         }
-        return;
-    } else if (node->kind == ND_WHILE){
-        int label = label_num;
-        label_num++;
+        gen_loc_none();
+        printf("\tjmp .Lend%d\n", cold.label);
+    }
+}
 
-        printf(".Lbegin%d:\n", label);
-        gen(node->lhs);
-        printf("\tpop rax\n");
-        printf("\tcmp rax, 0\n");
-        printf("\tje .Lend%d\n", label);
-        gen(node->rhs);
-        printf("\tjmp .Lbegin%d\n", label);
-        printf(".Lend%d:\n", label);
+void gen_lval(Node* node){
+    if (node->kind == ND_DEREF){
+        push_task(T_GEN, node->lhs, 0); // ポインタの値そのものがアドレス
         return;
-    } else if (node->kind == ND_FOR){
-        int label = label_num;
-        label_num++;
+    }
+    if (node->kind != ND_LVAR){
+        error("not a lvalue\n");
+    }
+    printf("\tmov rax, rbp\n");
+    printf("\tsub rax, %d\n", node->offset);
+    printf("\tpush rax\n");
+    return;
+}
 
-        gen(node->lhs->lhs->lhs);
-        printf(".Lbegin%d:\n", label);
-        gen(node->lhs->lhs->rhs);
-        printf("\tpop rax\n");
-        printf("\tcmp rax, 0\n");
-        printf("\tje .Lend%d\n", label);
-        gen(node->rhs);
-        gen(node->lhs->rhs);
-        printf("\tjmp .Lbegin%d\n", label);
-        printf(".Lend%d:\n", label);
-        return;
-    } else if (node->kind == ND_BLOCK){
-        while (node && node->lhs){
-            gen(node->lhs);
-            if (node->next) // 複文の最後の行では要らない
-                printf("\tpop rax\n");
-            node = node->next;
-        }
+// スタックトップのアドレスから値を読む(配列は先頭アドレスのまま使う)
+void load(Type* ty){
+    if (ty->kind == TY_ARRAY){
         return;
     }
-    gen(node->lhs);
-    gen(node->rhs);
+    printf("\tpop rax\n");
+    printf("\tmov rax, [rax]\n");
+    printf("\tpush rax\n");
+}
 
+void gen_binary(Node* node){
     printf("\tpop rdi\n"); // 2-1を考えるとこの順番になる
     printf("\tpop rax\n");
     if (node->kind == ND_ADD){
@@ -130,4 +229,341 @@ void gen(Node* node){
         printf("\tmovzb rax, al\n");
     }
     printf("\tpush rax\n");
-}
\ No newline at end of file
+}
+
+int compare_case(const void* a, const void* b){
+    int x = (*(Node**)a)->val;
+    int y = (*(Node**)b)->val;
+    return (x > y) - (x < y);
+}
+
+// switchのcaseを値の小さい順に並べた配列を返す
+Node** sorted_cases(Node* node, int* n){
+    *n = 0;
+    for (Node* c = node->case_next; c; c = c->case_next){
+        (*n)++;
+    }
+    Node** cases = (Node**)calloc(*n + 1, sizeof(Node*));
+    int i = 0;
+    for (Node* c = node->case_next; c; c = c->case_next){
+        cases[i++] = c;
+    }
+    qsort(cases, *n, sizeof(Node*), compare_case);
+    for (i = 1; i < *n; i++){
+        if (cases[i-1]->val == cases[i]->val){
+            error("duplicate case value %d\n", cases[i]->val);
+        }
+    }
+    return cases;
+}
+
+// caseに当てはまらないときの飛び先
+void jmp_default(Node* node){
+    if (node->default_case){
+        printf("\tjmp .Lcase%d\n", node->default_case->label);
+    } else {
+        printf("\tjmp .Lend%d\n", node->label);
+    }
+}
+
+// cases[lo..hi] の値の範囲を表で引く(raxが値)
+void gen_jump_table(Node* node, Node** cases, int lo, int hi){
+    int label = label_num;
+    label_num++;
+
+    long low = cases[lo]->val;
+    long range = (long)cases[hi]->val - low + 1;
+    printf("\tmov rdi, rax\n");
+    printf("\tsub rdi, %ld\n", low);
+    printf("\tcmp rdi, %ld\n", range - 1);
+    if (node->default_case){ // 符号なしで比べると low 未満も弾ける
+        printf("\tja .Lcase%d\n", node->default_case->label);
+    } else {
+        printf("\tja .Lend%d\n", node->label);
+    }
+    printf("\tlea rdx, .Lswt%d[rip]\n", label);
+    printf("\tmovsxd rdi, dword ptr [rdx+rdi*4]\n");
+    printf("\tadd rdi, rdx\n");
+    printf("\tjmp rdi\n");
+
+    // 表には表自身からの相対位置を置く(PIEでも再配置が要らない)
+    printf(".section .rodata\n");
+    printf(".balign 4\n");
+    printf(".Lswt%d:\n", label);
+    int i = lo;
+    for (long v = low; v < low + range; v++){
+        if (cases[i]->val == v){
+            printf("\t.long .Lcase%d-.Lswt%d\n", cases[i]->label, label);
+            i++;
+        } else if (node->default_case){
+            printf("\t.long .Lcase%d-.Lswt%d\n", node->default_case->label, label);
+        } else {
+            printf("\t.long .Lend%d-.Lswt%d\n", node->label, label);
+        }
+    }
+    printf(".text\n");
+}
+
+// 塊 clusters[lo..hi] を先頭の値で二分探索する
+// 塊は cases の添字の範囲で、表にするもの(start < end)と1つだけのものがある
+void gen_switch_tree(Node* node, Node** cases, int* starts, int* ends, int lo, int hi){
+    if (lo == hi){
+        if (starts[lo] < ends[lo]){
+            gen_jump_table(node, cases, starts[lo], ends[lo]);
+        } else {
+            printf("\tcmp rax, %d\n", cases[starts[lo]]->val);
+            printf("\tje .Lcase%d\n", cases[starts[lo]]->label);
+            jmp_default(node);
+        }
+        return;
+    }
+
+    int label = label_num;
+    label_num++;
+    int mid = (lo + hi + 1) / 2;
+    printf("\tcmp rax, %d\n", cases[starts[mid]]->val);
+    printf("\tjl .Lswl%d\n", label);
+    if (mid == hi && starts[hi] == ends[hi]){ // 比べた値そのものなら比べ直さない
+        printf("\tje .Lcase%d\n", cases[starts[hi]]->label);
+        jmp_default(node);
+    } else {
+        gen_switch_tree(node, cases, starts, ends, mid, hi);
+    }
+    gen_label("swl%d", label);
+    gen_switch_tree(node, cases, starts, ends, lo, mid-1);
+}
+
+// 並べたcaseを、密な範囲は表に、それ以外は1つずつの塊に分け、塊を二分探索する
+// 全体が密なら表だけ、まばらなら二分探索だけ、混ざっていればその組み合わせになる
+void gen_switch(Node* node){
+    int n;
+    Node** cases = sorted_cases(node, &n);
+
+    printf("\tpop rax\n");
+    if (n == 0){
+        jmp_default(node);
+        return;
+    }
+
+    int* starts = (int*)calloc(n, sizeof(int));
+    int* ends = (int*)calloc(n, sizeof(int));
+    int m = 0;
+    for (int i = 0; i < n; ){
+        // i から始まる一番長い密な範囲
+        int end = i;
+        for (int j = i + SWITCH_TABLE_MIN - 1; j < n; j++){
+            long range = (long)cases[j]->val - cases[i]->val + 1;
+            if (range * switch_density > (long)(n - i) * 100){
+                break; // 残りのcaseを全部入れても密にならないので、先を見ても無駄
+            }
+            if ((long)(j - i + 1) * 100 >= range * switch_density){
+                end = j;
+            }
+        }
+        starts[m] = i;
+        ends[m] = end;
+        m++;
+        i = end + 1;
+    }
+    gen_switch_tree(node, cases, starts, ends, 0, m-1);
+}
+
+// nodeの生成に必要な作業を積む
+void visit(Node* node){
+    // fprintf(stderr, "gen called(kind:%d)\n", node->kind);
+    if (node->kind == ND_NUM){
+        printf("\tpush %d\n", node->val);
+    } else if (node->kind == ND_ASSIGN){
+        if (node->lhs->ty->kind == TY_ARRAY){
+            error("not a lvalue\n");
+        }
+        push_task(T_STORE, node, 0);
+        push_task(T_GEN, node->rhs, 0);
+        push_task(T_LVAL, node->lhs, 0);
+    } else if (node->kind == ND_LVAR){
+        gen_lval(node);
+        load(node->ty);
+    } else if (node->kind == ND_DEREF){
+        push_task(T_LOAD, node, 0);
+        push_task(T_GEN, node->lhs, 0);
+    } else if (node->kind == ND_ADDR){
+        push_task(T_LVAL, node->lhs, 0);
+    } else if (node->kind == ND_RETURN){
+        push_task(T_RETURN, node, 0);
+        push_task(T_GEN, node->lhs, 0);
+    } else if (node->kind == ND_IF){
+        int label = label_num;
+        label_num++;
+
+        // elseがない場合、偽の側では代わりに0を積む(文は必ず値を1つ積む)
+        // プロファイルがあれば多く実行される側を真っすぐ実行し、まれな側は .Lelse に置く
+        int swap = profile_swap_if(node);
+        Node* fall = swap ? node->rhs : node->lhs->rhs;
+        Node* jump = swap ? node->lhs->rhs : node->rhs;
+        push_task(T_END, node, label);
+        if (profile_cold_if(node)){
+            push_cold(jump, node, label);
+        } else {
+            push_stmt(jump, node);
+            push_task(T_IF_ELSE, node, label);
+        }
+        push_stmt(fall, node);
+        push_task(swap ? T_IF_NCOND : T_IF_COND, node, label);
+        push_task(T_GEN, node->lhs->lhs, 0);
+    } else if (node->kind == ND_WHILE){
+        int label = label_num;
+        label_num++;
+        node->label = label;
+
+        // 熱いループは条件と本体を何回分か並べ、.Lbegin へ戻る回数を減らす
+        push_task(T_LOOP_END, node, label);
+        for (int i = profile_unroll(node); i > 0; i--){
+            push_task(T_POP, node, 0); // ループ中にスタックを伸ばさない
+            push_task(T_GEN, node->rhs, 0);
+            push_task(T_COND, node, label);
+            push_task(T_GEN, node->lhs, 0);
+        }
+        push_task(T_BEGIN, node, label);
+    } else if (node->kind == ND_FOR){
+        int label = label_num;
+        label_num++;
+        node->label = label;
+
+        push_task(T_LOOP_END, node, label);
+        for (int i = profile_unroll(node); i > 0; i--){
+            if (node->lhs->rhs){
+                push_task(T_POP, node, 0);
+                push_task(T_GEN, node->lhs->rhs, 0);
+            }
+            push_task(T_POP, node, 0);
+            push_task(T_GEN, node->rhs, 0);
+            if (node->lhs->lhs->rhs){
+                push_task(T_COND, node, label);
+                push_task(T_GEN, node->lhs->lhs->rhs, 0);
+            }
+        }
+        push_task(T_BEGIN, node, label);
+        if (node->vec){ // ベクトル化した本体を先に回し、残りを下のスカラーループで処理
+            push_task(T_VEC, node, 0);
+        }
+        if (node->lhs->lhs->lhs){
+            push_task(T_POP, node, 0);
+            push_task(T_GEN, node->lhs->lhs->lhs, 0);
+        }
+    } else if (node->kind == ND_SWITCH){
+        int label = label_num;
+        label_num++;
+        node->label = label;
+        for (Node* c = node->case_next; c; c = c->case_next){
+            c->label = label_num++;
+        }
+        if (node->default_case){
+            node->default_case->label = label_num++;
+        }
+
+        // 本体の値は捨て、breakで来ても合流できるようにしてから0を積む
+        push_task(T_PUSH0, node, 0);
+        push_task(T_END, node, label);
+        push_task(T_POP, node, 0);
+        push_task(T_GEN, node->rhs, 0);
+        push_task(T_DISPATCH, node, 0);
+        push_task(T_GEN, node->lhs, 0);
+    } else if (node->kind == ND_CASE){
+        gen_label("case%d", node->label);
+        push_task(T_GEN, node->lhs, 0);
+    } else if (node->kind == ND_BREAK){
+        // 文の先頭ではスタックの深さが外側の文と同じなので、そのまま飛べる
+        printf("\tjmp .Lend%d\n", node->target->label);
+    } else if (node->kind == ND_BLOCK){
+        if (!node->lhs){ // 空の複文
+            printf("\tpush 0\n");
+            return;
+        }
+        push_task(T_BLOCK, node, 0);
+    } else {
+        push_task(T_BINARY, node, 0);
+        push_task(T_GEN, node->rhs, 0);
+        push_task(T_GEN, node->lhs, 0);
+    }
+}
+
+void gen(Node* node){
+    int base = task_len;
+    push_task(T_GEN, node, 0);
+
+    while (task_len > base){
+        Task task = tasks[--task_len];
+        Node* node = task.node;
+        int label = task.label;
+        gen_loc(node);
+
+        if (task.kind == T_GEN){
+            visit(node);
+        } else if (task.kind == T_LVAL){
+            gen_lval(node);
+        } else if (task.kind == T_LOAD){
+            load(node->ty);
+        } else if (task.kind == T_STORE){
+            printf("\tpop rdi\n");
+            printf("\tpop rax\n");
+            printf("\tmov [rax], rdi\n");
+            printf("\tpush rdi\n");
+        } else if (task.kind == T_RETURN){
+            printf("\tpop rax\n");
+            printf("\tmov rsp, rbp\n");
+            printf("\tpop rbp\n");
+            printf("\tret\n");
+        } else if (task.kind == T_BINARY){
+            gen_binary(node);
+        } else if (task.kind == T_POP){
+            printf("\tpop rax\n");
+        } else if (task.kind == T_PUSH0){
+            printf("\tpush 0\n");
+        } else if (task.kind == T_BLOCK){
+            if (node->next && node->next->lhs){
+                push_task(T_BLOCK, node->next, 0);
+                push_task(T_POP, node, 0); // 複文の最後の行では要らない
+            }
+            push_task(T_GEN, node->lhs, 0);
+        } else if (task.kind == T_IF_COND){
+            printf("\tpop rax\n");
+            printf("\tcmp rax, 0\n");
+            printf("\tje .Lelse%d\n", label);
+            if (profile_generate){
+                gen_prof_inc(node, 0);
+            }
+        } else if (task.kind == T_IF_NCOND){
+            printf("\tpop rax\n");
+            printf("\tcmp rax, 0\n");
+            printf("\tjne .Lelse%d\n", label);
+        } else if (task.kind == T_IF_ELSE){
+            printf("\tjmp .Lend%d\n", label);
+            gen_label("else%d", label);
+            if (profile_generate){
+                gen_prof_inc(node, 1);
+            }
+        } else if (task.kind == T_BEGIN){
+            gen_label("begin%d", label);
+            if (profile_generate){
+                gen_prof_inc(node, 0);
+            }
+        } else if (task.kind == T_COND){
+            printf("\tpop rax\n");
+            printf("\tcmp rax, 0\n");
+            printf("\tje .Lend%d\n", label);
+        } else if (task.kind == T_LOOP_END){
+            printf("\tjmp .Lbegin%d\n", label);
+            gen_label("end%d", label);
+            if (profile_generate){
+                gen_prof_inc(node, 1);
+            }
+            printf("\tpush 0\n");
+        } else if (task.kind == T_END){
+            gen_label("end%d", label);
+        } else if (task.kind == T_VEC){
+            gen_vec_loop(node);
+        } else if (task.kind == T_DISPATCH){
+            gen_switch(node);
+        }
+    }
+}
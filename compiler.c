@@ -3,33 +3,144 @@
 Token* token;
 char* user_input;
 
+// 標準入力をすべて読む(コマンドライン引数に収まらない大きな入力用)
+char* read_stdin(){
+    size_t len = 0;
+    size_t cap = 4096;
+    char* buf = (char*)malloc(cap);
+    size_t n;
+    while ((n = fread(buf + len, 1, cap - len - 1, stdin)) > 0){
+        len += n;
+        if (cap - len - 1 == 0){
+            cap *= 2;
+            buf = (char*)realloc(buf, cap);
+        }
+    }
+    buf[len] = '\0';
+    return buf;
+}
+
 int main(int argc, char** argv){    
-    if (argc != 2){
-        fprintf(stderr, "usage: ./compiler code\n");
+    int interp = 0;
+    int stats = 0;
+    int gvn = 1;
+    char* profile_use = NULL;
+    char* source_name = NULL; // -g で .file に書くソースのパス
+    int from_stdin = 0;
+    user_input = NULL;
+    for (int i=1; i<argc; i++){
+        if (strcmp(argv[i], "--interp") == 0){
+            interp = 1; // アセンブリを出さずにその場で実行する
+        } else if (strcmp(argv[i], "--stats") == 0){
+            stats = 1;
+        } else if (strcmp(argv[i], "--no-gvn") == 0){
+            gvn = 0; // 共通部分式を削除しない
+        } else if (strcmp(argv[i], "--profile-generate") == 0){
+            profile_generate = "default.prof"; // 分岐の実行回数を数えて終了時に書き出す
+        } else if (strncmp(argv[i], "--profile-generate=", 19) == 0){
+            profile_generate = argv[i] + 19;
+        } else if (strncmp(argv[i], "--profile-use=", 14) == 0){
+            profile_use = argv[i] + 14;
+        } else if (strncmp(argv[i], "--switch-density=", 17) == 0){
+            switch_density = atoi(argv[i] + 17);
+            if (switch_density < 1 || switch_density > 100){
+                fprintf(stderr, "--switch-density must be 1 to 100\n");
+                return 1;
+            }
+        } else if (strcmp(argv[i], "-g") == 0){
+            debug_info = 1; // 行番号の表を出す
+        } else if (strncmp(argv[i], "--source-name=", 14) == 0){
+            source_name = argv[i] + 14; // perf annotate などがソースを読めるよう、本当のパスを渡す
+        } else if (strcmp(argv[i], "-") == 0){
+            user_input = read_stdin();
+            from_stdin = 1;
+        } else if (argv[i][0] == '-' && argv[i][1] == '-'){
+            fprintf(stderr, "unknown option: %s\n", argv[i]);
+            return 1;
+        } else {
+            user_input = argv[i];
+        }
+    }
+    if (!user_input){
+        fprintf(stderr, "usage: ./compiler [-g [--source-name=path]] [--interp] [--stats] [--no-gvn] [--switch-density=N]\n"
+                        "                  [--profile-generate[=file] | --profile-use=file] (code | -)\n");
+        return 1;
+    }
+
+    if ((profile_generate || profile_use) && interp){
+        fprintf(stderr, "profile options cannot be used with --interp\n");
+        return 1;
+    }
+    if (profile_generate && profile_use){
+        fprintf(stderr, "--profile-generate and --profile-use cannot be used together\n");
         return 1;
     }
 
-    user_input = argv[1];
     token = tokenize(user_input);
     parse_program();
+    if (profile_use){
+        read_profile(profile_use);
+    }
+    if (!interp){
+        vectorize_program(); // ベクトル化するループはGVNで形を変えないよう先に決める
+    }
+    if (gvn){
+        gvn_program();
+        if (stats){
+            fprintf(stderr, "gvn: %d expressions eliminated\n", gvn_eliminated);
+        }
+    }
+    if (interp){
+        return interp_program(stats);
+    }
     // fprintf(stderr, "token::");
     // print_tree(node, 0);
 
     printf(".intel_syntax noprefix\n");
+    if (debug_info){
+        if (!source_name){
+            source_name = from_stdin ? "<stdin>" : "<command line>";
+        }
+        printf(".file 1 \"");
+        for (char* p = source_name; *p; p++){
+            if (*p == '"' || *p == '\\'){
+                printf("\\");
+            }
+            printf("%c", *p);
+        }
+        printf("\"\n");
+        printf(".file 2 \"<generated>\"\n");
+    }
     printf(".globl main\n");
     printf("main:\n");
 
     printf("\tpush rbp\n");
     printf("\tmov rbp, rsp\n");
+    if (profile_generate){
+        gen_prof_init();
+    }
     printf("\tsub rsp, %d\n", locals->offset);
+    if (vectorized){
+        gen_cpu_detect();
+    }
 
     for (int i=0; code[i] != NULL; i++){
         gen(code[i]);
         printf("\tpop rax\n");
     }
 
+    gen_loc_none();
     printf("\tmov rsp, rbp\n");
     printf("\tpop rbp\n");
     printf("\tret\n"); // スタックをポップして関数の呼び出し元に戻る
+    gen_cold_blocks();
+
+    if (profile_generate){
+        gen_prof_data();
+    }
+
+    if (vectorized){
+        gen_vec_data();
+    }
     return 0;
 }
\ No newline at end of file
@@ -13,6 +13,11 @@ typedef enum {
     TK_ELSE,
     TK_WHILE,
     TK_FOR,
+    TK_SWITCH,
+    TK_CASE,
+    TK_DEFAULT,
+    TK_BREAK,
+    TK_INT,
     TK_NUM,
     TK_IDENT,
     TK_EOF
@@ -23,7 +28,7 @@ typedef struct Token Token;
 struct Token {
     TokenKind kind;
     int val;
-    char* str;
+    char* str; // user_input の中を指す(終端の\0はない)
     int len;
     Token* next; // 連結リストを作る
 };
@@ -44,19 +49,51 @@ typedef enum {
     ND_WHILE,
     ND_FOR,
     ND_BLOCK,
+    ND_SWITCH,
+    ND_CASE, // case/default ラベルの付いた文
+    ND_BREAK,
+    ND_ADDR, // 単項&
+    ND_DEREF, // 単項*
     ND_LVAR,
     ND_NUM
 } NodeKind;
 
+// 型の定義
+typedef enum {
+    TY_INT, // 8バイト整数
+    TY_PTR,
+    TY_ARRAY
+} TypeKind;
+
+typedef struct Type Type;
+
+struct Type {
+    TypeKind kind;
+    Type* ptr_to; // ポインタ・配列の要素の型
+    int array_size; // 配列の要素数
+};
+
+typedef struct VecLoop VecLoop;
+
 typedef struct Node Node;
 
 struct Node {
     NodeKind kind;
     int val;
     int offset; // 変数のベースポインタからのオフセット
+    Type* ty;
     Node* lhs; // 木構造を作る
     Node* rhs;
     Node* next; // 連結リスト用
+    VecLoop* vec; // ベクトル化できるforループの解析結果
+
+    Node* case_next; // switchのcaseの連結リスト
+    Node* default_case;
+    Node* target; // breakで抜ける文
+    int label; // コード生成時に割り当てる飛び先
+    int prof; // if/while/forのプロファイルのカウンタ番号
+    char* loc; // ソース上の位置(user_input の中を指す)
+    int* assigned; // GVN: 部分木で代入される変数のオフセット(-1で終わる。求めていなければNULL)
 };
 
 // ローカル変数の型
@@ -66,6 +103,7 @@ struct LVar {
     char* name;
     int len;
     int offset;
+    Type* ty;
     LVar* next; // 連結リストを作る
 };
 
@@ -77,9 +115,42 @@ extern Node* code[100];
 
 extern LVar* locals;
 
+extern int label_num;
+extern int debug_info;
+extern int vectorized;
+extern int switch_density;
+extern int gvn_eliminated;
+extern int branch_num;
+extern char* profile_generate;
+
 Token* tokenize(char* p);
 void parse_program();
 void gen(Node* node);
+void gen_label(char* fmt, ...);
+void gen_loc_none();
+Node** sorted_cases(Node* node, int* n);
+
+Type* new_type_int();
+Type* pointer_to(Type* base);
+Type* array_of(Type* base, int size);
+int size_of(Type* ty);
+
+int interp_program(int stats);
+
+void vectorize_program();
+void gvn_program();
+void gen_vec_loop(Node* node);
+void gen_cpu_detect();
+void gen_vec_data();
+
+void read_profile(char* path);
+int profile_swap_if(Node* node);
+int profile_cold_if(Node* node);
+int profile_unroll(Node* node);
+void gen_prof_inc(Node* node, int counter);
+void gen_prof_init();
+void gen_prof_data();
+void gen_cold_blocks();
 
 void print_list(Token* token);
 void print_tree(Node* node, int depth);
@@ -0,0 +1,578 @@
+#include "compiler.h"
+
+// 大域値番号付け(GVN)による共通部分式の削除
+// 構文木を実行順にたどり、変数の読み出しと副作用のない int の二項演算に値番号を付ける。
+// 同じ演算子と同じ値番号の被演算子を持つ式が、支配する位置ですでに計算されていれば
+// 最初の式の値を隠れた一時変数に保存し、後の式はその一時変数を読むだけにする。
+//
+// 構造化された制御フローなので、支配木は構文木から決まる:
+//   if の条件は then/else と if の後を支配し、then と else は互いを支配しない
+//   ループの先頭は本体を支配し、ループの中で代入される変数は先頭で新しい値番号になる
+//   switch の各 case は switch の先頭だけに支配される
+// 分岐やループに入るときに表の位置を覚え、出るときにそこまで戻す(スコープ付きの表)。
+// 代入された変数は新しい値番号になるので、その変数を使う古い式はもう一致しない。
+// アドレスを取られた変数はポインタ経由で書き換わりうるので対象にしない。
+
+typedef struct {
+    Node* def; // 最初に計算した式
+    int temp; // 値を保存する一時変数のオフセット(使われなければ0)
+} Entry;
+
+typedef struct {
+    NodeKind kind;
+    long lhs; // 被演算子の値番号
+    long rhs;
+    long vn; // この式の値番号
+    int entry;
+    int next; // 同じバケットの次の項目
+} Avail;
+
+typedef struct {
+    Node* node;
+    int entry;
+} Use;
+
+int gvn_eliminated = 0;
+
+Entry* entries;
+int entry_len;
+int entry_cap;
+Avail* avails; // 今の位置で使える式(後に積んだものほど内側のスコープ)
+int avail_len;
+int avail_cap;
+int* buckets; // 各バケットで最後に積んだ項目
+int bucket_cap;
+Use* uses;
+int use_len;
+int use_cap;
+
+typedef struct {
+    int offset;
+    long vn; // 書き換える前の値番号
+} Change;
+
+long* versions; // 変数(オフセット)の今の値番号
+char* addr_taken;
+long vn_next = 2; // 値番号は偶数、数値 n は 2n+1 で表す
+Change* changes; // versions を書き換えた記録(if の枝を出るときに戻す)
+int change_len;
+int change_cap;
+
+long new_vn(){
+    long vn = vn_next;
+    vn_next += 2;
+    return vn;
+}
+
+void set_version(int offset, long vn){
+    if (change_len == change_cap){
+        change_cap = change_cap ? change_cap * 2 : 256;
+        changes = (Change*)realloc(changes, sizeof(Change) * change_cap);
+    }
+    changes[change_len].offset = offset;
+    changes[change_len].vn = versions[offset];
+    change_len++;
+    versions[offset] = vn;
+}
+
+// versions を記録の mark の位置まで戻す
+void undo_versions(int mark){
+    while (change_len > mark){
+        change_len--;
+        versions[changes[change_len].offset] = changes[change_len].vn;
+    }
+}
+
+int hash_key(NodeKind kind, long lhs, long rhs){
+    unsigned long h = kind * 31 + (unsigned long)lhs * 1000003 + (unsigned long)rhs * 998244353;
+    return (h ^ (h >> 17)) % bucket_cap;
+}
+
+Avail* find_avail(NodeKind kind, long lhs, long rhs){
+    for (int i = buckets[hash_key(kind, lhs, rhs)]; i >= 0; i = avails[i].next){
+        if (avails[i].kind == kind && avails[i].lhs == lhs && avails[i].rhs == rhs){
+            return &avails[i];
+        }
+    }
+    return NULL;
+}
+
+// 積んだ順に入れ直すので、バケットの先頭は内側のスコープのままになる
+void rehash(int cap){
+    bucket_cap = cap;
+    buckets = (int*)realloc(buckets, sizeof(int) * cap);
+    for (int i=0; i<cap; i++){
+        buckets[i] = -1;
+    }
+    for (int i=0; i<avail_len; i++){
+        Avail* a = &avails[i];
+        int h = hash_key(a->kind, a->lhs, a->rhs);
+        a->next = buckets[h];
+        buckets[h] = i;
+    }
+}
+
+long add_avail(Node* def, long lhs, long rhs){
+    if (entry_len == entry_cap){
+        entry_cap = entry_cap ? entry_cap * 2 : 256;
+        entries = (Entry*)realloc(entries, sizeof(Entry) * entry_cap);
+    }
+    entries[entry_len].def = def;
+    entries[entry_len].temp = 0;
+
+    if (avail_len == avail_cap){
+        avail_cap = avail_cap ? avail_cap * 2 : 256;
+        avails = (Avail*)realloc(avails, sizeof(Avail) * avail_cap);
+    }
+    if (avail_len == bucket_cap){
+        rehash(bucket_cap * 2);
+    }
+    int h = hash_key(def->kind, lhs, rhs);
+    Avail* a = &avails[avail_len];
+    a->kind = def->kind;
+    a->lhs = lhs;
+    a->rhs = rhs;
+    a->vn = new_vn();
+    a->entry = entry_len++;
+    a->next = buckets[h];
+    buckets[h] = avail_len++;
+    return a->vn;
+}
+
+// 表を mark の位置まで戻す
+void pop_avails(int mark){
+    while (avail_len > mark){
+        avail_len--;
+        Avail* a = &avails[avail_len];
+        buckets[hash_key(a->kind, a->lhs, a->rhs)] = a->next;
+    }
+}
+
+void add_use(Node* node, int entry){
+    if (use_len == use_cap){
+        use_cap = use_cap ? use_cap * 2 : 256;
+        uses = (Use*)realloc(uses, sizeof(Use) * use_cap);
+    }
+    uses[use_len].node = node;
+    uses[use_len].entry = entry;
+    use_len++;
+}
+
+int is_tracked_var(Node* node){
+    return node->kind == ND_LVAR && node->ty->kind == TY_INT && !addr_taken[node->offset];
+}
+
+int is_gvn_op(NodeKind kind){
+    return kind == ND_ADD || kind == ND_SUB || kind == ND_MUL || kind == ND_DIV ||
+           kind == ND_EQ || kind == ND_NEQ || kind == ND_LT || kind == ND_LEQ;
+}
+
+// 部分木をたどるための作業スタック(式は深くなりうるので再帰しない)
+typedef struct {
+    Node* node;
+    int state;
+    int avail_mark; // 子をたどり始める時点の表の位置
+    int use_mark;
+} Frame;
+
+Frame* frames;
+int frame_len;
+int frame_cap;
+
+typedef struct {
+    long vn;
+    int pure; // 副作用がなく、値番号で比べてよい
+} Value;
+
+Value* values;
+int value_len;
+int value_cap;
+
+void push_frame(Node* node){
+    if (frame_len == frame_cap){
+        frame_cap = frame_cap ? frame_cap * 2 : 256;
+        frames = (Frame*)realloc(frames, sizeof(Frame) * frame_cap);
+    }
+    frames[frame_len].node = node;
+    frames[frame_len].state = 0;
+    frame_len++;
+}
+
+void push_value(long vn, int pure){
+    if (value_len == value_cap){
+        value_cap = value_cap ? value_cap * 2 : 256;
+        values = (Value*)realloc(values, sizeof(Value) * value_cap);
+    }
+    values[value_len].vn = vn;
+    values[value_len].pure = pure;
+    value_len++;
+}
+
+// 式を評価順(gen()と同じ順)にたどって値番号を付け、その値番号を返す
+long gvn_expr(Node* node){
+    int base = frame_len;
+    push_frame(node);
+
+    while (frame_len > base){
+        Frame* f = &frames[frame_len-1];
+        Node* node = f->node;
+
+        if (f->state == 0){
+            // 子を積む前に覚える(積んだ時点では左の兄弟がまだ登録していない)
+            f->state = 1;
+            f->avail_mark = avail_len;
+            f->use_mark = use_len;
+            if (node->kind == ND_NUM){
+                frame_len--;
+                push_value((long)node->val * 2 + 1, 1);
+            } else if (node->kind == ND_LVAR){
+                frame_len--;
+                if (is_tracked_var(node)){
+                    push_value(versions[node->offset], 1);
+                } else {
+                    push_value(new_vn(), 0);
+                }
+            } else if (node->kind == ND_ADDR){
+                if (node->lhs->kind == ND_DEREF){
+                    push_frame(node->lhs->lhs);
+                } else {
+                    push_value(0, 0); // 子の値の代わり
+                }
+            } else if (node->kind == ND_DEREF){
+                push_frame(node->lhs);
+            } else if (node->kind == ND_ASSIGN){
+                // gen()と同じく代入先のアドレスを先に計算する
+                push_frame(node->rhs);
+                if (node->lhs->kind == ND_DEREF){
+                    push_frame(node->lhs->lhs);
+                }
+            } else {
+                push_frame(node->rhs);
+                push_frame(node->lhs);
+            }
+            continue;
+        }
+
+        frame_len--;
+        if (node->kind == ND_ADDR || node->kind == ND_DEREF){
+            value_len--;
+            push_value(new_vn(), 0);
+        } else if (node->kind == ND_ASSIGN){
+            Value val = values[--value_len];
+            if (node->lhs->kind == ND_DEREF){
+                value_len--;
+            }
+            if (is_tracked_var(node->lhs)){
+                set_version(node->lhs->offset, val.vn); // 代入した変数は右辺と同じ値
+            }
+            push_value(val.vn, 0);
+        } else {
+            Value rhs = values[--value_len];
+            Value lhs = values[--value_len];
+            if (!lhs.pure || !rhs.pure || !is_gvn_op(node->kind) || node->ty->kind != TY_INT){
+                push_value(new_vn(), 0);
+                continue;
+            }
+            if ((node->kind == ND_ADD || node->kind == ND_MUL || node->kind == ND_EQ || node->kind == ND_NEQ) &&
+                lhs.vn > rhs.vn){ // 可換な演算は被演算子の順番をそろえる
+                long tmp = lhs.vn;
+                lhs.vn = rhs.vn;
+                rhs.vn = tmp;
+            }
+            Avail* a = find_avail(node->kind, lhs.vn, rhs.vn);
+            if (a){
+                // 式ごと置き換えるので、部分式で登録したものは取り消す
+                pop_avails(f->avail_mark);
+                use_len = f->use_mark;
+                add_use(node, a->entry);
+                push_value(a->vn, 1);
+            } else {
+                push_value(add_avail(node, lhs.vn, rhs.vn), 1);
+            }
+        }
+    }
+    return values[--value_len].vn;
+}
+
+int no_vars[] = {-1};
+int* var_stamp; // 変数ごとに、最後に集合へ入れたときの番号(重複を除く)
+int stamp_num;
+
+// 部分木で代入される変数の集合を求めて node->assigned に置く
+// 中にある集合を求め済みの部分木はたどらずにその集合を使うので、
+// 内側から順に求めれば各節点をたどるのは1回で済む
+void cache_assigned(Node* node){
+    if (!node || node->assigned){
+        return;
+    }
+    stamp_num++;
+    int* vars = NULL;
+    int len = 0;
+    int cap = 0;
+    int base = frame_len;
+    push_frame(node);
+    while (frame_len > base){
+        Node* cur = frames[--frame_len].node;
+        int* found = cur->assigned;
+        int one[2] = {-1, -1};
+        if (!found){
+            if (cur->kind == ND_ASSIGN && is_tracked_var(cur->lhs)){
+                one[0] = cur->lhs->offset;
+            }
+            found = one;
+            if (cur->lhs){
+                push_frame(cur->lhs);
+            }
+            if (cur->rhs){
+                push_frame(cur->rhs);
+            }
+            if (cur->kind == ND_BLOCK && cur->next){
+                push_frame(cur->next);
+            }
+        }
+        for (; *found >= 0; found++){
+            if (var_stamp[*found] == stamp_num){
+                continue;
+            }
+            var_stamp[*found] = stamp_num;
+            if (len + 1 >= cap){
+                cap = cap ? cap * 2 : 8;
+                vars = (int*)realloc(vars, sizeof(int) * cap);
+            }
+            vars[len++] = *found;
+        }
+    }
+    if (len == 0){
+        node->assigned = no_vars;
+        return;
+    }
+    vars[len] = -1;
+    node->assigned = vars;
+}
+
+// 合流点やループの先頭で値番号を新しくする部分木の集合を、内側から求めておく
+void collect_assigned(Node* node){
+    int base = frame_len;
+    push_frame(node);
+    while (frame_len > base){
+        Frame* f = &frames[frame_len-1];
+        Node* node = f->node;
+        if (f->state == 0){
+            f->state = 1;
+            if (node->lhs){
+                push_frame(node->lhs);
+            }
+            if (node->rhs){
+                push_frame(node->rhs);
+            }
+            if (node->kind == ND_BLOCK && node->next){
+                push_frame(node->next);
+            }
+            continue;
+        }
+        frame_len--;
+        if (node->kind == ND_IF){
+            cache_assigned(node->lhs->rhs);
+            cache_assigned(node->rhs);
+        } else if (node->kind == ND_WHILE){
+            cache_assigned(node);
+        } else if (node->kind == ND_FOR){
+            cache_assigned(node->lhs->lhs->rhs);
+            cache_assigned(node->lhs->rhs);
+            cache_assigned(node->rhs);
+        } else if (node->kind == ND_SWITCH){
+            cache_assigned(node->rhs);
+        }
+    }
+}
+
+// 部分木の中で代入される変数を新しい値番号にする(合流点やループの先頭)
+void refresh_assigned(Node* node){
+    if (!node){
+        return;
+    }
+    for (int* v = node->assigned; *v >= 0; v++){
+        set_version(*v, new_vn());
+    }
+}
+
+// case がすべて本体の一番外側にあるか(中の文に飛び込む switch は最適化しない)
+int is_flat_switch(Node* node){
+    int n = node->default_case ? 1 : 0;
+    for (Node* c = node->case_next; c; c = c->case_next){
+        n++;
+    }
+    for (Node* cur = node->rhs; cur; cur = cur->next){
+        Node* stmt = cur->kind == ND_BLOCK ? cur->lhs : cur;
+        for (; stmt && stmt->kind == ND_CASE; stmt = stmt->lhs){
+            n--;
+        }
+        if (cur->kind != ND_BLOCK){
+            break;
+        }
+    }
+    return n == 0;
+}
+
+Node* gvn_switch; // 今たどっているswitch
+int gvn_switch_mark;
+
+void gvn_stmt(Node* node){
+    if (node->kind == ND_BLOCK){
+        for (; node && node->lhs; node = node->next){
+            gvn_stmt(node->lhs);
+        }
+    } else if (node->kind == ND_RETURN){
+        gvn_expr(node->lhs);
+    } else if (node->kind == ND_IF){
+        gvn_expr(node->lhs->lhs);
+
+        int mark = avail_len;
+        int change_mark = change_len;
+        gvn_stmt(node->lhs->rhs);
+        pop_avails(mark);
+        undo_versions(change_mark);
+        if (node->rhs){
+            gvn_stmt(node->rhs);
+            pop_avails(mark);
+            undo_versions(change_mark);
+        }
+        refresh_assigned(node->lhs->rhs);
+        refresh_assigned(node->rhs);
+    } else if (node->kind == ND_WHILE){
+        refresh_assigned(node);
+        int mark = avail_len;
+        gvn_expr(node->lhs);
+        gvn_stmt(node->rhs);
+        pop_avails(mark);
+        refresh_assigned(node);
+    } else if (node->kind == ND_FOR){
+        if (node->lhs->lhs->lhs){
+            gvn_expr(node->lhs->lhs->lhs);
+        }
+        Node* cond = node->lhs->lhs->rhs;
+        Node* inc = node->lhs->rhs;
+        refresh_assigned(cond);
+        refresh_assigned(inc);
+        refresh_assigned(node->rhs);
+        if (node->vec){ // ベクトル化したループの中は形を変えない
+            return;
+        }
+        int mark = avail_len;
+        if (cond){
+            gvn_expr(cond);
+        }
+        gvn_stmt(node->rhs);
+        if (inc){
+            gvn_expr(inc);
+        }
+        pop_avails(mark);
+        refresh_assigned(cond);
+        refresh_assigned(inc);
+        refresh_assigned(node->rhs);
+    } else if (node->kind == ND_SWITCH){
+        gvn_expr(node->lhs);
+        refresh_assigned(node->rhs);
+        if (!is_flat_switch(node)){
+            return;
+        }
+        Node* sw = gvn_switch;
+        int sw_mark = gvn_switch_mark;
+        gvn_switch = node;
+        gvn_switch_mark = avail_len;
+        gvn_stmt(node->rhs);
+        pop_avails(gvn_switch_mark);
+        gvn_switch = sw;
+        gvn_switch_mark = sw_mark;
+        refresh_assigned(node->rhs);
+    } else if (node->kind == ND_CASE){
+        // switchの先頭から飛んでくるので、本体で計算したものは使えない
+        pop_avails(gvn_switch_mark);
+        refresh_assigned(gvn_switch->rhs);
+        gvn_stmt(node->lhs);
+    } else if (node->kind == ND_BREAK){
+        return;
+    } else {
+        gvn_expr(node);
+    }
+}
+
+// アドレスを取られている変数に印を付ける
+void mark_addr_taken(Node* node){
+    int base = frame_len;
+    push_frame(node);
+    while (frame_len > base){
+        Node* node = frames[--frame_len].node;
+        if (node->kind == ND_ADDR && node->lhs->kind == ND_LVAR){
+            addr_taken[node->lhs->offset] = 1;
+        }
+        if (node->lhs){
+            push_frame(node->lhs);
+        }
+        if (node->rhs){
+            push_frame(node->rhs);
+        }
+        if (node->kind == ND_BLOCK && node->next){
+            push_frame(node->next);
+        }
+    }
+}
+
+int new_temp(){
+    LVar* lvar = (LVar*)calloc(1, sizeof(LVar));
+    lvar->name = ""; // 名前がないのでソースの変数とは一致しない
+    lvar->len = 0;
+    lvar->ty = new_type_int();
+    lvar->offset = locals->offset + 8;
+    lvar->next = locals;
+    locals = lvar;
+    return lvar->offset;
+}
+
+Node* new_temp_node(int offset){
+    Node* node = (Node*)calloc(1, sizeof(Node));
+    node->kind = ND_LVAR;
+    node->offset = offset;
+    node->ty = new_type_int();
+    return node;
+}
+
+void gvn_program(){
+    int n = locals->offset + 1;
+    versions = (long*)calloc(n, sizeof(long));
+    addr_taken = (char*)calloc(n, sizeof(char));
+    var_stamp = (int*)calloc(n, sizeof(int));
+    for (int i=0; i<n; i++){
+        versions[i] = new_vn();
+    }
+    rehash(1024);
+    for (int i=0; code[i] != NULL; i++){
+        mark_addr_taken(code[i]);
+    }
+    for (int i=0; code[i] != NULL; i++){
+        collect_assigned(code[i]);
+    }
+
+    for (int i=0; code[i] != NULL; i++){
+        gvn_stmt(code[i]);
+    }
+
+    // 最初の式は一時変数への代入に、後の式は一時変数の読み出しに書き換える
+    for (int i=0; i<use_len; i++){
+        Entry* e = &entries[uses[i].entry];
+        if (!e->temp){
+            e->temp = new_temp();
+            Node* copy = (Node*)calloc(1, sizeof(Node));
+            *copy = *e->def;
+            e->def->kind = ND_ASSIGN;
+            e->def->lhs = new_temp_node(e->temp);
+            e->def->rhs = copy;
+        }
+        Node* use = uses[i].node;
+        use->kind = ND_LVAR;
+        use->offset = e->temp;
+        use->lhs = NULL;
+        use->rhs = NULL;
+    }
+    gvn_eliminated = use_len;
+}
@@ -0,0 +1,432 @@
+#include "compiler.h"
+#include <time.h>
+
+// code[] の構文木をレジスタ型のバイトコードに変換し、その場で実行する
+// ローカル変数はネイティブと同じくベースポインタからのオフセットでフレームに置くので、
+// ポインタ演算の結果もネイティブのコードと一致する
+// 命令の振り分けは計算型goto(GCC拡張)によるスレッデッドコード
+
+typedef enum {
+    OP_IMM, // a = c
+    OP_MOV, // a = b
+    OP_LOAD, // a = ローカル変数(オフセット c)
+    OP_STORE, // ローカル変数(オフセット c) = b
+    OP_ADDR, // a = ローカル変数(オフセット c)のアドレス
+    OP_LOADP, // a = *b
+    OP_STOREP, // *a = b
+    OP_ADD, // a = b + c (以下同様)
+    OP_SUB,
+    OP_MUL,
+    OP_DIV,
+    OP_EQ,
+    OP_NEQ,
+    OP_LT,
+    OP_LEQ,
+    OP_JZ, // a == 0 なら c へ
+    OP_JMP, // c へ
+    OP_SWITCH, // a の値で表 switches[c] を二分探索して飛ぶ
+    OP_RET // a を返して終了
+} OpCode;
+
+typedef struct {
+    int op;
+    int a;
+    int b;
+    int c;
+} Insn;
+
+typedef struct {
+    int n;
+    long* vals; // 小さい順
+    int* targets;
+    int def; // どのcaseにも当てはまらないときの飛び先
+} SwitchTable;
+
+SwitchTable* switches;
+int switch_len;
+
+Insn* insns;
+int insn_len;
+int insn_cap;
+int reg_top; // 次に使う一時レジスタ
+int reg_max;
+
+int emit(int op, int a, int b, int c){
+    if (insn_len == insn_cap){
+        insn_cap = insn_cap ? insn_cap * 2 : 256;
+        insns = (Insn*)realloc(insns, sizeof(Insn) * insn_cap);
+    }
+    insns[insn_len].op = op;
+    insns[insn_len].a = a;
+    insns[insn_len].b = b;
+    insns[insn_len].c = c;
+    return insn_len++;
+}
+
+int ops_of(NodeKind kind){
+    static const int ops[] = {
+        [ND_ADD] = OP_ADD, [ND_SUB] = OP_SUB, [ND_MUL] = OP_MUL, [ND_DIV] = OP_DIV,
+        [ND_EQ] = OP_EQ, [ND_NEQ] = OP_NEQ, [ND_LT] = OP_LT, [ND_LEQ] = OP_LEQ,
+    };
+    return ops[kind];
+}
+
+// 構文木は再帰を使わず、やることを明示的なスタックに積んでたどる
+// どのノードも開始時点の reg_top を結果のレジスタにし、終わるとそれより後ろを解放する
+typedef enum {
+    L_EXPR, // node の値を reg に入れる
+    L_ADDR, // node のアドレスを reg に入れる
+    L_LOADP, // reg = *reg
+    L_STORE, // ローカル変数 node->lhs = reg
+    L_STOREP, // *reg = reg+1
+    L_BINARY, // reg = reg op reg+1
+    L_RET,
+    L_MOV, // reg = reg+1
+    L_BLOCK, // 複文の node 以降の文
+    L_MARK, // ループの先頭を覚える
+    L_JZ, // reg+1 が 0 なら(後で決まる)飛び先へ
+    L_NOJZ, // 条件のないfor
+    L_IF_ELSE, // then節の終わり
+    L_IF_END,
+    L_LOOP_END,
+    L_SWITCH, // reg+1 の値で各caseへ飛ぶ
+    L_SWITCH_END,
+    L_CASE,
+    L_BREAK
+} LowerKind;
+
+typedef struct {
+    LowerKind kind;
+    Node* node;
+    int reg;
+} LowerTask;
+
+LowerTask* lower_tasks;
+int lower_len;
+int lower_cap;
+int* fixups; // 飛び先が決まっていない命令の位置・ループの先頭
+int fixup_len;
+int fixup_cap;
+LowerTask* breaks; // 飛び先が決まっていないbreak(node に抜ける文、reg に命令の位置)
+int break_len;
+int break_cap;
+
+void push_lower(LowerKind kind, Node* node, int reg){
+    if (lower_len == lower_cap){
+        lower_cap = lower_cap ? lower_cap * 2 : 256;
+        lower_tasks = (LowerTask*)realloc(lower_tasks, sizeof(LowerTask) * lower_cap);
+    }
+    lower_tasks[lower_len].kind = kind;
+    lower_tasks[lower_len].node = node;
+    lower_tasks[lower_len].reg = reg;
+    lower_len++;
+}
+
+void push_fixup(int pos){
+    if (fixup_len == fixup_cap){
+        fixup_cap = fixup_cap ? fixup_cap * 2 : 64;
+        fixups = (int*)realloc(fixups, sizeof(int) * fixup_cap);
+    }
+    fixups[fixup_len++] = pos;
+}
+
+void push_break(Node* target, int pos){
+    if (break_len == break_cap){
+        break_cap = break_cap ? break_cap * 2 : 64;
+        breaks = (LowerTask*)realloc(breaks, sizeof(LowerTask) * break_cap);
+    }
+    breaks[break_len].node = target;
+    breaks[break_len].reg = pos;
+    break_len++;
+}
+
+// node を抜けるbreakの飛び先を今の位置にする
+// 内側の文のbreakはその文の終わりで解決済みなので、後ろから見ればよい
+void fix_breaks(Node* node){
+    while (break_len > 0 && breaks[break_len-1].node == node){
+        break_len--;
+        insns[breaks[break_len].reg].c = insn_len;
+    }
+}
+
+// switchの表を作る(caseの位置は node->label に入っている)
+void build_switch(Node* node, int pos){
+    int n;
+    Node** cases = sorted_cases(node, &n);
+    SwitchTable* t = &switches[insns[pos].c];
+    t->n = n;
+    t->vals = (long*)calloc(n + 1, sizeof(long));
+    t->targets = (int*)calloc(n + 1, sizeof(int));
+    for (int i=0; i<n; i++){
+        t->vals[i] = cases[i]->val;
+        t->targets[i] = cases[i]->label;
+    }
+    t->def = node->default_case ? node->default_case->label : insn_len;
+    free(cases);
+}
+
+// nodeの生成に必要な作業を後から実行するものから順に積む
+void lower_visit(Node* node, int reg){
+    if (node->kind == ND_NUM){
+        emit(OP_IMM, reg, 0, node->val);
+    } else if (node->kind == ND_LVAR){
+        if (node->ty->kind == TY_ARRAY){ // 配列は先頭アドレス
+            emit(OP_ADDR, reg, 0, node->offset);
+        } else {
+            emit(OP_LOAD, reg, 0, node->offset);
+        }
+    } else if (node->kind == ND_DEREF){
+        if (node->ty->kind != TY_ARRAY){
+            push_lower(L_LOADP, node, reg);
+        }
+        push_lower(L_EXPR, node->lhs, reg);
+    } else if (node->kind == ND_ADDR){
+        push_lower(L_ADDR, node->lhs, reg);
+    } else if (node->kind == ND_ASSIGN){
+        if (node->lhs->ty->kind == TY_ARRAY){
+            error("not a lvalue\n");
+        }
+        if (node->lhs->kind == ND_LVAR){
+            push_lower(L_STORE, node, reg);
+            push_lower(L_EXPR, node->rhs, reg);
+        } else {
+            push_lower(L_STOREP, node, reg);
+            push_lower(L_EXPR, node->rhs, reg+1);
+            push_lower(L_ADDR, node->lhs, reg);
+        }
+    } else if (node->kind == ND_RETURN){
+        push_lower(L_RET, node, reg);
+        push_lower(L_EXPR, node->lhs, reg);
+    } else if (node->kind == ND_IF){
+        // 文の結果は reg に、子の値は reg+1 で計算する
+        push_lower(L_IF_END, node, reg);
+        if (node->rhs){
+            push_lower(L_MOV, node, reg);
+            push_lower(L_EXPR, node->rhs, reg+1);
+        }
+        push_lower(L_IF_ELSE, node, reg);
+        push_lower(L_MOV, node, reg);
+        push_lower(L_EXPR, node->lhs->rhs, reg+1);
+        push_lower(L_JZ, node, reg);
+        push_lower(L_EXPR, node->lhs->lhs, reg+1);
+    } else if (node->kind == ND_WHILE){
+        push_lower(L_LOOP_END, node, reg);
+        push_lower(L_EXPR, node->rhs, reg+1);
+        push_lower(L_JZ, node, reg);
+        push_lower(L_EXPR, node->lhs, reg+1);
+        push_lower(L_MARK, node, reg);
+    } else if (node->kind == ND_FOR){
+        push_lower(L_LOOP_END, node, reg);
+        if (node->lhs->rhs){
+            push_lower(L_EXPR, node->lhs->rhs, reg+1);
+        }
+        push_lower(L_EXPR, node->rhs, reg+1);
+        if (node->lhs->lhs->rhs){
+            push_lower(L_JZ, node, reg);
+            push_lower(L_EXPR, node->lhs->lhs->rhs, reg+1);
+        } else {
+            push_lower(L_NOJZ, node, reg);
+        }
+        push_lower(L_MARK, node, reg);
+        if (node->lhs->lhs->lhs){
+            push_lower(L_EXPR, node->lhs->lhs->lhs, reg+1);
+        }
+    } else if (node->kind == ND_SWITCH){
+        push_lower(L_SWITCH_END, node, reg);
+        push_lower(L_EXPR, node->rhs, reg+1);
+        push_lower(L_SWITCH, node, reg);
+        push_lower(L_EXPR, node->lhs, reg+1);
+    } else if (node->kind == ND_CASE){
+        push_lower(L_EXPR, node->lhs, reg);
+        push_lower(L_CASE, node, reg);
+    } else if (node->kind == ND_BREAK){
+        push_lower(L_BREAK, node, reg);
+    } else if (node->kind == ND_BLOCK){
+        if (!node->lhs){
+            emit(OP_IMM, reg, 0, 0);
+        } else {
+            push_lower(L_BLOCK, node, reg);
+        }
+    } else {
+        push_lower(L_BINARY, node, reg);
+        push_lower(L_EXPR, node->rhs, reg+1);
+        push_lower(L_EXPR, node->lhs, reg);
+    }
+}
+
+// nodeの値を計算し、結果の入ったレジスタを返す
+int lower(Node* node){
+    int base = lower_len;
+    int result = reg_top;
+    push_lower(L_EXPR, node, result);
+
+    while (lower_len > base){
+        LowerTask task = lower_tasks[--lower_len];
+        Node* node = task.node;
+        int reg = task.reg;
+        if (reg + 1 > reg_max){
+            reg_max = reg + 1;
+        }
+
+        if (task.kind == L_EXPR){
+            lower_visit(node, reg);
+        } else if (task.kind == L_ADDR){
+            if (node->kind == ND_DEREF){
+                push_lower(L_EXPR, node->lhs, reg);
+            } else if (node->kind == ND_LVAR){
+                emit(OP_ADDR, reg, 0, node->offset);
+            } else {
+                error("not a lvalue\n");
+            }
+        } else if (task.kind == L_LOADP){
+            emit(OP_LOADP, reg, reg, 0);
+        } else if (task.kind == L_STORE){
+            emit(OP_STORE, 0, reg, node->lhs->offset);
+        } else if (task.kind == L_STOREP){
+            emit(OP_STOREP, reg, reg+1, 0);
+            emit(OP_MOV, reg, reg+1, 0);
+        } else if (task.kind == L_BINARY){
+            emit(ops_of(node->kind), reg, reg, reg+1);
+        } else if (task.kind == L_RET){
+            emit(OP_RET, reg, 0, 0);
+        } else if (task.kind == L_MOV){
+            emit(OP_MOV, reg, reg+1, 0);
+        } else if (task.kind == L_BLOCK){
+            if (node->next && node->next->lhs){
+                push_lower(L_BLOCK, node->next, reg);
+            }
+            push_lower(L_MOV, node, reg);
+            push_lower(L_EXPR, node->lhs, reg+1);
+        } else if (task.kind == L_MARK){
+            push_fixup(insn_len);
+        } else if (task.kind == L_JZ){
+            push_fixup(emit(OP_JZ, reg+1, 0, 0));
+        } else if (task.kind == L_NOJZ){
+            push_fixup(-1);
+        } else if (task.kind == L_IF_ELSE){
+            int jz = fixups[--fixup_len];
+            push_fixup(emit(OP_JMP, 0, 0, 0));
+            insns[jz].c = insn_len;
+            if (!node->rhs){
+                emit(OP_IMM, reg, 0, 0); // 文は必ず値を持つ
+            }
+        } else if (task.kind == L_IF_END){
+            insns[fixups[--fixup_len]].c = insn_len;
+        } else if (task.kind == L_LOOP_END){
+            int jz = fixups[--fixup_len];
+            int begin = fixups[--fixup_len];
+            emit(OP_JMP, 0, 0, begin);
+            if (jz >= 0){
+                insns[jz].c = insn_len;
+            }
+            fix_breaks(node);
+            emit(OP_IMM, reg, 0, 0);
+        } else if (task.kind == L_SWITCH){
+            switches = (SwitchTable*)realloc(switches, sizeof(SwitchTable) * (switch_len + 1));
+            push_fixup(emit(OP_SWITCH, reg+1, 0, switch_len++));
+        } else if (task.kind == L_SWITCH_END){
+            build_switch(node, fixups[--fixup_len]);
+            fix_breaks(node);
+            emit(OP_IMM, reg, 0, 0);
+        } else if (task.kind == L_CASE){
+            node->label = insn_len;
+        } else if (task.kind == L_BREAK){
+            push_break(node->target, emit(OP_JMP, 0, 0, 0));
+        }
+    }
+    reg_top = result + 1;
+    return result;
+}
+
+void lower_program(){
+    insn_len = 0;
+    reg_top = 1; // r0 は直前の文の値(ネイティブのrax)
+    reg_max = 1;
+    for (int i=0; code[i] != NULL; i++){
+        emit(OP_MOV, 0, lower(code[i]), 0);
+        reg_top = 1;
+    }
+    emit(OP_RET, 0, 0, 0);
+}
+
+long run(long* count){
+    long* regs = (long*)calloc(reg_max, sizeof(long));
+    char* frame = (char*)calloc(locals->offset + 8, 1);
+    char* bp = frame + locals->offset; // [bp - offset] に変数を置く
+    long executed = 0;
+
+    static void* dispatch[] = {
+        &&op_imm, &&op_mov, &&op_load, &&op_store, &&op_addr, &&op_loadp, &&op_storep,
+        &&op_add, &&op_sub, &&op_mul, &&op_div, &&op_eq, &&op_neq, &&op_lt, &&op_leq,
+        &&op_jz, &&op_jmp, &&op_switch, &&op_ret,
+    };
+
+    Insn* ip = insns;
+#define NEXT do { executed++; goto *dispatch[ip->op]; } while (0)
+#define A regs[ip->a]
+#define B regs[ip->b]
+#define C regs[ip->c]
+    NEXT;
+
+op_imm:    A = ip->c; ip++; NEXT;
+op_mov:    A = B; ip++; NEXT;
+op_load:   A = *(long*)(bp - ip->c); ip++; NEXT;
+op_store:  *(long*)(bp - ip->c) = B; ip++; NEXT;
+op_addr:   A = (long)(bp - ip->c); ip++; NEXT;
+op_loadp:  A = *(long*)B; ip++; NEXT;
+op_storep: *(long*)A = B; ip++; NEXT;
+op_add:    A = (unsigned long)B + C; ip++; NEXT; // ネイティブと同じく桁あふれは切り捨て
+op_sub:    A = (unsigned long)B - C; ip++; NEXT;
+op_mul:    A = (unsigned long)B * C; ip++; NEXT;
+op_div:    A = B / C; ip++; NEXT;
+op_eq:     A = B == C; ip++; NEXT;
+op_neq:    A = B != C; ip++; NEXT;
+op_lt:     A = B < C; ip++; NEXT;
+op_leq:    A = B <= C; ip++; NEXT;
+op_jz:     ip = A ? ip + 1 : insns + ip->c; NEXT;
+op_jmp:    ip = insns + ip->c; NEXT;
+op_switch:
+    {
+        SwitchTable* t = &switches[ip->c];
+        int lo = 0, hi = t->n;
+        while (lo < hi){
+            int mid = (lo + hi) / 2;
+            if (t->vals[mid] < A){
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        ip = insns + ((lo < t->n && t->vals[lo] == A) ? t->targets[lo] : t->def);
+    }
+    NEXT;
+op_ret:
+#undef NEXT
+#undef A
+#undef B
+#undef C
+    {
+        long ret = regs[ip->a];
+        free(regs);
+        free(frame);
+        *count = executed;
+        return ret;
+    }
+}
+
+// プログラムを実行し、ネイティブと同じく値の下位8bitを終了コードとして返す
+int interp_program(int stats){
+    lower_program();
+
+    long count;
+    clock_t start = clock();
+    long ret = run(&count);
+    clock_t end = clock();
+
+    if (stats){
+        double sec = (double)(end - start) / CLOCKS_PER_SEC;
+        fprintf(stderr, "insns: %d, regs: %d\n", insn_len, reg_max);
+        fprintf(stderr, "executed: %ld in %.6f sec (%.1f Minsn/s)\n", count, sec, count / sec / 1e6);
+    }
+    return ret & 255;
+}
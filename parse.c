@@ -5,30 +5,31 @@
 // stmt       = expr ";" | "{" stmt* "}" | "return" expr ";" |
 //              "if" "(" expr ")" stmt ( "else" stmt )? |
 //              "while" "(" expr ")" stmt |
-//              "for" "(" expr? ";" expr? ";" expr ")" stmt
+//              "for" "(" expr? ";" expr? ";" expr ")" stmt |
+//              "switch" "(" expr ")" stmt |
+//              "case" "-"? num ":" stmt | "default" ":" stmt | "break" ";" |
+//              "int" "*"* ident ( "[" num "]" )* ";"
 // expr       = assign
 // assign     = equality ( "=" assign )?
 // equality   = relational ("==" relational || "!=" relational)*
 // relational = add ("<" add || "<=" add || ">" add || ">=" add)*
 // add        = mul ("+" mul | "-" mul)*
 // mul        = unary ("*" unary | "/" unary)*
-// unary      = ("+" | "-")? primary
+// unary      = ("+" | "-" | "*" | "&") unary | postfix
+// postfix    = primary ( "[" expr "]" )*
 // primary    = num | ident | "(" expr ")"
 // (優先順位が高い演算子ほど先に計算したいので下に来る)
 // ("="は右結合であることに注意)
+// (宣言されていない変数はint型として扱う)
+// (expr以下は優先順位法で読むので、関数はparse_exprとparse_primaryだけ)
 
 // トークンによる中間表現をノード(木構造)による中間表現に変換
 
 // 関数の宣言
 void parse_program();
 Node* parse_stmt();
+Node* parse_declaration();
 Node* parse_expr();
-Node* parse_assign();
-Node* parse_equality();
-Node* parse_relational();
-Node* parse_add();
-Node* parse_mul();
-Node* parse_unary();
 Node* parse_primary();
 
 int consume_type(TokenKind kind);
@@ -67,7 +68,7 @@ void print_list(Token* token){
         if (token->kind == TK_NUM){
             fprintf(stderr, ", val:%d", token->val);
         } else if (token->kind == TK_RESERVED || token->kind == TK_IDENT){
-            fprintf(stderr, ", str:%s", token->str);
+            fprintf(stderr, ", str:%.*s", token->len, token->str);
         }
         fprintf(stderr, "\n");
         token = token->next;
@@ -96,8 +97,7 @@ Token* new_token(TokenKind kind, Token* cur, char* p, int len){
     cur = cur->next;
 
     cur->kind = kind;
-    cur->str = (char*)calloc(len, sizeof(char));
-    strncpy(cur->str, p, len);
+    cur->str = p; // user_input の中を指す(エラーや行番号の位置に使う)
     cur->len = len;
     return cur;
 }
@@ -120,7 +120,7 @@ Token* tokenize(char* p){
             p += 2;
             continue;
         } else if (*p == '+' || *p == '-' || *p == '*' || *p == '/' || *p == '(' || *p == ')' || *p == '<'  || *p == '>'  ||
-                   *p == '=' || *p == ';' || *p == '{' || *p == '}'){
+                   *p == '=' || *p == ';' || *p == '{' || *p == '}' || *p == '[' || *p == ']' || *p == '&' || *p == ':'){
             cur = new_token(TK_RESERVED, cur, p, 1);
             // fprintf(stderr, "p: %s\n", p);
             p++;
@@ -151,6 +151,26 @@ Token* tokenize(char* p){
             cur = new_token(TK_FOR, cur, p, 1);
             p += 3;
             continue;
+        } else if (strncmp(p, "switch", 6)==0 && !is_alnum(*(p+6))){
+            cur = new_token(TK_SWITCH, cur, p, 1);
+            p += 6;
+            continue;
+        } else if (strncmp(p, "case", 4)==0 && !is_alnum(*(p+4))){
+            cur = new_token(TK_CASE, cur, p, 1);
+            p += 4;
+            continue;
+        } else if (strncmp(p, "default", 7)==0 && !is_alnum(*(p+7))){
+            cur = new_token(TK_DEFAULT, cur, p, 1);
+            p += 7;
+            continue;
+        } else if (strncmp(p, "break", 5)==0 && !is_alnum(*(p+5))){
+            cur = new_token(TK_BREAK, cur, p, 1);
+            p += 5;
+            continue;
+        } else if (strncmp(p, "int", 3)==0 && !is_alnum(*(p+3))){
+            cur = new_token(TK_INT, cur, p, 1);
+            p += 3;
+            continue;
         } else if ('a' <= *p && *p <= 'z'){
             int len = get_ident(p);
             cur = new_token(TK_IDENT, cur, p, len);
@@ -167,73 +187,121 @@ Token* tokenize(char* p){
 
 
 // 構文木とノードの関数
+// 再帰を使わずに木をたどるため、表示する子を明示的なスタックに積む
+typedef struct {
+    Node* node; // NULL なら text を表示する
+    char* text;
+    int depth;
+    int indent; // 親の下に字下げして表示する
+} PrintItem;
+
+PrintItem* print_items;
+int print_len;
+int print_cap;
+
+void push_print(Node* node, char* text, int depth){
+    if (print_len == print_cap){
+        print_cap = print_cap ? print_cap * 2 : 64;
+        print_items = (PrintItem*)realloc(print_items, sizeof(PrintItem) * print_cap);
+    }
+    print_items[print_len].node = node;
+    print_items[print_len].text = text;
+    print_items[print_len].depth = depth;
+    print_items[print_len].indent = 1;
+    print_len++;
+}
+
+// 子は後から表示するものから順に積む
 void print_tree(Node* node, int depth){
-    fprintf(stderr, "- type:%d", node->kind);
-    if (node->kind == ND_NUM){
-        fprintf(stderr, ",val:%d\n", node->val);
-    } else if (node->kind == ND_LVAR){
-        fprintf(stderr, ",offset:%d\n", node->offset);
-    } else if (node->kind == ND_RETURN){
-        fprintf(stderr, "\n");
-        fprintf(stderr, "%*s", 2*depth, " ");
-        print_tree(node->lhs, depth+1);
-    } else if (node->kind == ND_IF){
-        fprintf(stderr, "\n");
-        fprintf(stderr, "%*s", 2*depth, " ");
-        print_tree(node->lhs->lhs, depth+1);
-        fprintf(stderr, "%*s", 2*depth, " ");
-        print_tree(node->lhs->rhs, depth+1);
-        if (node->rhs){
-            fprintf(stderr, "%*s", 2*depth, " ");
-            print_tree(node->rhs, depth+1);
+    int base = print_len;
+    push_print(node, NULL, depth);
+    print_items[base].indent = 0;
+
+    while (print_len > base){
+        PrintItem item = print_items[--print_len];
+        node = item.node;
+        depth = item.depth;
+        if (item.indent){
+            fprintf(stderr, "%*s", 2*(depth-1), " ");
         }
-    } else if (node->kind == ND_WHILE){
-        fprintf(stderr, "\n");
-        fprintf(stderr, "%*s", 2*depth, " ");
-        print_tree(node->lhs, depth+1);
-        fprintf(stderr, "%*s", 2*depth, " ");
-        print_tree(node->rhs, depth+1);
-    } else if (node->kind == ND_FOR){
-        fprintf(stderr, "\n");
-        if (node->lhs->lhs->lhs){
-            fprintf(stderr, "%*s", 2*depth, " ");
-            print_tree(node->lhs->lhs->lhs, depth+1);
-        } else {
-            fprintf(stderr, "%*s", 2*depth, " ");
-            fprintf(stderr, "[no init]\n");
-        }
-        if (node->lhs->lhs->rhs){
-            fprintf(stderr, "%*s", 2*depth, " ");
-            print_tree(node->lhs->lhs->rhs, depth+1);
-        } else {
-            fprintf(stderr, "%*s", 2*depth, " ");
-            fprintf(stderr, "[no cond]\n");
+        if (!node){
+            fprintf(stderr, "%s\n", item.text);
+            continue;
         }
-        if (node->lhs->rhs){
-            fprintf(stderr, "%*s", 2*depth, " ");
-            print_tree(node->lhs->rhs, depth+1);
-        } else {
-            fprintf(stderr, "%*s", 2*depth, " ");
-            fprintf(stderr, "[no final]\n");
+
+        fprintf(stderr, "- type:%d", node->kind);
+        if (node->kind == ND_NUM){
+            fprintf(stderr, ",val:%d\n", node->val);
+            continue;
+        } else if (node->kind == ND_LVAR){
+            fprintf(stderr, ",offset:%d\n", node->offset);
+            continue;
         }
-        fprintf(stderr, "%*s", 2*depth, " ");
-        print_tree(node->rhs, depth+1);
-    } else if (node->kind == ND_BLOCK) {
         fprintf(stderr, "\n");
-        while (node && node->lhs){
-            fprintf(stderr, "%*s", 2*depth, " ");
-            print_tree(node->lhs, depth+1);
-            node = node->next;
+
+        if (node->kind == ND_BREAK){
+            continue;
+        } else if (node->kind == ND_RETURN || node->kind == ND_ADDR || node->kind == ND_DEREF || node->kind == ND_CASE){
+            push_print(node->lhs, NULL, depth+1);
+        } else if (node->kind == ND_IF){
+            if (node->rhs){
+                push_print(node->rhs, NULL, depth+1);
+            }
+            push_print(node->lhs->rhs, NULL, depth+1);
+            push_print(node->lhs->lhs, NULL, depth+1);
+        } else if (node->kind == ND_FOR){
+            push_print(node->rhs, NULL, depth+1);
+            push_print(node->lhs->rhs, "[no final]", depth+1);
+            push_print(node->lhs->lhs->rhs, "[no cond]", depth+1);
+            push_print(node->lhs->lhs->lhs, "[no init]", depth+1);
+        } else if (node->kind == ND_BLOCK){
+            int n = 0;
+            for (Node* cur = node; cur && cur->lhs; cur = cur->next){
+                push_print(cur->lhs, NULL, depth+1);
+                n++;
+            }
+            // 積んだ順と逆に表示されるので並べ替える
+            for (int i=0; i<n/2; i++){
+                PrintItem tmp = print_items[print_len-1-i];
+                print_items[print_len-1-i] = print_items[print_len-n+i];
+                print_items[print_len-n+i] = tmp;
+            }
+        } else { // 二項演算, ND_WHILE, ND_SWITCH, ND_ASSIGN
+            push_print(node->rhs, NULL, depth+1);
+            push_print(node->lhs, NULL, depth+1);
         }
-    } else {
-        fprintf(stderr, "\n");
-        fprintf(stderr, "%*s", 2*depth, " ");
-        print_tree(node->lhs, depth+1);
-        fprintf(stderr, "%*s", 2*depth, " ");
-        print_tree(node->rhs, depth+1);
     }
 }
 
+// 型の関数
+Type* new_type_int(){
+    Type* ty = (Type*)calloc(1, sizeof(Type));
+    ty->kind = TY_INT;
+    return ty;
+}
+
+Type* pointer_to(Type* base){
+    Type* ty = (Type*)calloc(1, sizeof(Type));
+    ty->kind = TY_PTR;
+    ty->ptr_to = base;
+    return ty;
+}
+
+Type* array_of(Type* base, int size){
+    Type* ty = (Type*)calloc(1, sizeof(Type));
+    ty->kind = TY_ARRAY;
+    ty->ptr_to = base;
+    ty->array_size = size;
+    return ty;
+}
+
+int size_of(Type* ty){
+    if (ty->kind == TY_ARRAY){
+        return size_of(ty->ptr_to) * ty->array_size;
+    }
+    return 8; // intもポインタも8バイト
+}
+
 LVar* locals;
 
 LVar* find_lvar(Token* tok){
@@ -250,6 +318,11 @@ Node* new_node(NodeKind kind, Node* lhs, Node* rhs){
     node->kind = kind;
     node->lhs = lhs;
     node->rhs = rhs;
+    if (kind == ND_ASSIGN){
+        node->ty = lhs->ty;
+    } else {
+        node->ty = new_type_int(); // 比較演算などの結果はint
+    }
     return node;
 }
 
@@ -258,28 +331,88 @@ Node* new_node_num(int val){
     Node* node = (Node*)calloc(1, sizeof(Node));
     node->kind = ND_NUM;
     node->val = val;
+    node->ty = new_type_int();
+    return node;
+}
+
+int is_pointer(Node* node){
+    return node->ty->kind == TY_PTR || node->ty->kind == TY_ARRAY;
+}
+
+// ポインタ演算では整数の側を要素のサイズ倍する
+Node* new_node_add(Node* lhs, Node* rhs){
+    if (is_pointer(lhs) && is_pointer(rhs)){
+        error("invalid operands to binary +\n");
+    }
+    if (!is_pointer(lhs) && is_pointer(rhs)){ // int + ptr は ptr + int にする
+        Node* tmp = lhs;
+        lhs = rhs;
+        rhs = tmp;
+    }
+    if (!is_pointer(lhs)){
+        return new_node(ND_ADD, lhs, rhs);
+    }
+    rhs = new_node(ND_MUL, rhs, new_node_num(size_of(lhs->ty->ptr_to)));
+    Node* node = new_node(ND_ADD, lhs, rhs);
+    node->ty = pointer_to(lhs->ty->ptr_to);
     return node;
 }
 
+Node* new_node_sub(Node* lhs, Node* rhs){
+    if (!is_pointer(lhs)){
+        if (is_pointer(rhs)){
+            error("invalid operands to binary -\n");
+        }
+        return new_node(ND_SUB, lhs, rhs);
+    }
+    int size = size_of(lhs->ty->ptr_to);
+    if (is_pointer(rhs)){ // ptr - ptr は要素数の差
+        return new_node(ND_DIV, new_node(ND_SUB, lhs, rhs), new_node_num(size));
+    }
+    rhs = new_node(ND_MUL, rhs, new_node_num(size));
+    Node* node = new_node(ND_SUB, lhs, rhs);
+    node->ty = pointer_to(lhs->ty->ptr_to);
+    return node;
+}
+
+Node* new_node_deref(Node* lhs){
+    if (!is_pointer(lhs)){
+        error("invalid pointer dereference\n");
+    }
+    Node* node = new_node(ND_DEREF, lhs, NULL);
+    node->ty = lhs->ty->ptr_to;
+    return node;
+}
+
+Node* new_node_addr(Node* lhs){
+    Node* node = new_node(ND_ADDR, lhs, NULL);
+    node->ty = pointer_to(lhs->ty);
+    return node;
+}
+
+LVar* new_lvar(Token* tok, Type* ty){
+    LVar* lvar = (LVar*)calloc(1, sizeof(LVar));
+    lvar->name = tok->str;
+    lvar->len = tok->len;
+    lvar->ty = ty;
+    lvar->offset = locals->offset + size_of(ty);
+
+    lvar->next = locals; // 逆向きに追加
+    locals = lvar;
+    return lvar;
+}
+
 Node* new_node_ident(Token* tok){
     // fprintf(stderr, "number registered(value:%d)\n", val);
     Node* node = (Node*)calloc(1, sizeof(Node));
     node->kind = ND_LVAR;
 
     LVar* lvar = find_lvar(tok);
-    if (lvar){
-        node->offset = lvar->offset;
-    } else {
-        lvar = (LVar*)calloc(1, sizeof(LVar));
-        lvar->name = (char*)calloc(tok->len, sizeof(char));
-        strncpy(lvar->name, tok->str, tok->len);
-        lvar->len = tok->len;
-        lvar->offset = locals->offset + 8;
-        node->offset = lvar->offset;
-
-        lvar->next = locals; // 逆向きに追加
-        locals = lvar;
+    if (!lvar){
+        lvar = new_lvar(tok, new_type_int());
     }
+    node->offset = lvar->offset;
+    node->ty = lvar->ty;
 
     return node;
 }
@@ -298,6 +431,9 @@ Node* new_node_block(NodeKind kind, Node* cur, Node* child){
 // パース関数
 Node* code[100];
 
+Node* cur_switch; // 今読んでいるswitch文
+Node* cur_break; // breakで抜ける文(一番内側のループかswitch)
+
 void parse_program(){
     int i=0;
     locals = (LVar*)calloc(1, sizeof(LVar));
@@ -313,6 +449,7 @@ void parse_program(){
 Node* parse_stmt(){
     // fprintf(stderr, "parse_stmt called\n");
     Node* node;
+    char* loc = token->str; // 文の先頭
 
     if (consume("{")){
         Node* head = (Node*)calloc(1, sizeof(Node));
@@ -325,6 +462,8 @@ Node* parse_stmt(){
         } else {
             node = new_node(ND_BLOCK, NULL, NULL);
         }
+    } else if (consume_type(TK_INT)){
+        node = parse_declaration();
     } else if (consume_type(TK_RETURN)){
         node = new_node(ND_RETURN, parse_expr(), NULL);
         expect(";");
@@ -338,11 +477,58 @@ Node* parse_stmt(){
         } else {
             node = new_node(ND_IF, node, NULL);
         }
+        node->prof = branch_num++;
     } else if (consume_type(TK_WHILE)){
         expect("(");
         node = parse_expr();
         expect(")");
-        node = new_node(ND_WHILE, node, parse_stmt());
+        node = new_node(ND_WHILE, node, NULL);
+        node->prof = branch_num++;
+        Node* brk = cur_break;
+        cur_break = node;
+        node->rhs = parse_stmt();
+        cur_break = brk;
+    } else if (consume_type(TK_SWITCH)){
+        expect("(");
+        node = parse_expr();
+        expect(")");
+        node = new_node(ND_SWITCH, node, NULL);
+        Node* sw = cur_switch;
+        Node* brk = cur_break;
+        cur_switch = node;
+        cur_break = node;
+        node->rhs = parse_stmt();
+        cur_switch = sw;
+        cur_break = brk;
+    } else if (consume_type(TK_CASE)){
+        if (!cur_switch){
+            error_at(token->str, "case outside of switch\n");
+        }
+        int sign = consume("-") ? -1 : 1;
+        node = new_node(ND_CASE, NULL, NULL);
+        node->val = sign * expect_number();
+        expect(":");
+        node->case_next = cur_switch->case_next; // 逆向きに追加
+        cur_switch->case_next = node;
+        node->lhs = parse_stmt();
+    } else if (consume_type(TK_DEFAULT)){
+        if (!cur_switch){
+            error_at(token->str, "default outside of switch\n");
+        }
+        if (cur_switch->default_case){
+            error_at(token->str, "multiple default labels in one switch\n");
+        }
+        expect(":");
+        node = new_node(ND_CASE, NULL, NULL);
+        cur_switch->default_case = node;
+        node->lhs = parse_stmt();
+    } else if (consume_type(TK_BREAK)){
+        if (!cur_break){
+            error_at(token->str, "break outside of loop or switch\n");
+        }
+        expect(";");
+        node = new_node(ND_BREAK, NULL, NULL);
+        node->target = cur_break;
     } else if (consume_type(TK_FOR)){
         expect("(");
         if (consume(";")){
@@ -363,144 +549,271 @@ Node* parse_stmt(){
             node = new_node(ND_FOR, node, parse_expr());
             expect(")");
         }
-        node = new_node(ND_FOR, node, parse_stmt());
+        node = new_node(ND_FOR, node, NULL);
+        node->prof = branch_num++;
+        Node* brk = cur_break;
+        cur_break = node;
+        node->rhs = parse_stmt();
+        cur_break = brk;
     } else {
         node = parse_expr();
         expect(";");
     }
+    if (!node->loc){ // 式文は式の演算子の位置のまま
+        node->loc = loc;
+    }
     return node;
 }
 
-Node* parse_expr(){
-    // fprintf(stderr, "parse_expr called\n");
-    return parse_assign();    
-}
+Node* parse_declaration(){
+    Type* ty = new_type_int();
+    while (consume("*")){
+        ty = pointer_to(ty);
+    }
+    Token* tok = consume_ident();
+    if (!tok){
+        error_at(token->str, "expected identifier\n");
+    }
+    if (find_lvar(tok)){
+        error_at(tok->str, "redeclared variable\n");
+    }
 
-Node* parse_assign(){
-    Node* node = parse_equality();
+    // int a[2][3] は「intの配列(3)」の配列(2)なので後ろから組み立てる
+    int sizes[16];
+    int n = 0;
+    while (consume("[")){
+        if (n == 16){
+            error_at(token->str, "too many array dimensions\n");
+        }
+        sizes[n++] = expect_number();
+        expect("]");
+    }
+    for (int i = n-1; i >= 0; i--){
+        ty = array_of(ty, sizes[i]);
+    }
+    expect(";");
 
-    if (consume("=")){
-        node = new_node(ND_ASSIGN, node, parse_assign());
+    new_lvar(tok, ty);
+    return new_node(ND_BLOCK, NULL, NULL); // 宣言自体は空文
+}
+
+// 式は再帰下降ではなく、明示的なスタックを使った優先順位法で読む
+// (どれだけ深く入れ子になった式でもCのスタックを使い切らない)
+typedef enum {
+    OPR_BINARY, // 二項演算子
+    OPR_PREFIX, // 単項演算子
+    OPR_PAREN, // "(" の開き
+    OPR_INDEX // "[" の開き
+} OprKind;
+
+typedef struct {
+    OprKind kind;
+    char* op;
+    int prec; // 大きいほど強く結合する
+    char* loc; // 演算子のソース上の位置
+} Opr;
+
+#define PREC_ASSIGN 1 // "=" だけが右結合
+
+struct {
+    char* op;
+    int prec;
+} binary_ops[] = {
+    {"=", PREC_ASSIGN},
+    {"==", 2}, {"!=", 2},
+    {"<", 3}, {"<=", 3}, {">", 3}, {">=", 3},
+    {"+", 4}, {"-", 4},
+    {"*", 5}, {"/", 5},
+    {NULL, 0}
+};
+
+char* prefix_ops[] = {"+", "-", "*", "&", NULL};
+
+Node** vals; // 被演算子のスタック
+int val_len;
+int val_cap;
+Opr* oprs; // 演算子のスタック
+int opr_len;
+int opr_cap;
+
+void push_val(Node* node){
+    if (val_len == val_cap){
+        val_cap = val_cap ? val_cap * 2 : 64;
+        vals = (Node**)realloc(vals, sizeof(Node*) * val_cap);
     }
-    return node;
+    vals[val_len++] = node;
 }
 
-Node* parse_equality(){
-    // fprintf(stderr, "parse_equality called\n");
-    Node* node = parse_relational();
+void push_opr(OprKind kind, char* op, int prec, char* loc){
+    if (opr_len == opr_cap){
+        opr_cap = opr_cap ? opr_cap * 2 : 64;
+        oprs = (Opr*)realloc(oprs, sizeof(Opr) * opr_cap);
+    }
+    oprs[opr_len].kind = kind;
+    oprs[opr_len].op = op;
+    oprs[opr_len].prec = prec;
+    oprs[opr_len].loc = loc;
+    opr_len++;
+}
 
-    for(;;){
-        if(consume("==")){
-            node = new_node(ND_EQ, node, parse_relational());
-            // print_tree(node, 0);
-            continue;
-        } else if(consume("!=")){
-            node = new_node(ND_NEQ, node, parse_relational());
-            // print_tree(node, 0);
-            continue;
-        }
-        return node;
+Node* new_node_binary(char* op, Node* lhs, Node* rhs){
+    if (strcmp(op, "=") == 0){
+        return new_node(ND_ASSIGN, lhs, rhs);
+    } else if (strcmp(op, "==") == 0){
+        return new_node(ND_EQ, lhs, rhs);
+    } else if (strcmp(op, "!=") == 0){
+        return new_node(ND_NEQ, lhs, rhs);
+    } else if (strcmp(op, "<") == 0){
+        return new_node(ND_LT, lhs, rhs);
+    } else if (strcmp(op, "<=") == 0){
+        return new_node(ND_LEQ, lhs, rhs);
+    } else if (strcmp(op, ">") == 0){
+        return new_node(ND_LT, rhs, lhs);
+    } else if (strcmp(op, ">=") == 0){
+        return new_node(ND_LEQ, rhs, lhs);
+    } else if (strcmp(op, "+") == 0){
+        return new_node_add(lhs, rhs);
+    } else if (strcmp(op, "-") == 0){
+        return new_node_sub(lhs, rhs);
+    } else if (strcmp(op, "*") == 0){
+        return new_node(ND_MUL, lhs, rhs);
     }
+    return new_node(ND_DIV, lhs, rhs);
 }
 
-Node* parse_relational(){
-    // fprintf(stderr, "parse_equality called\n");
-    Node* node = parse_add();
+Node* new_node_prefix(char* op, Node* node){
+    if (strcmp(op, "-") == 0){
+        return new_node_sub(new_node_num(0), node);
+    } else if (strcmp(op, "*") == 0){
+        return new_node_deref(node);
+    } else if (strcmp(op, "&") == 0){
+        return new_node_addr(node);
+    }
+    return node;
+}
 
-    for(;;){
-        if(consume("<")){
-            node = new_node(ND_LT, node, parse_add());
-            // print_tree(node, 0);
-            continue;
-        } else if(consume("<=")){
-            node = new_node(ND_LEQ, node, parse_add());
-            // print_tree(node, 0);
-            continue;
-        } else if(consume(">")){
-            node = new_node(ND_LT, parse_add(), node);
-            // print_tree(node, 0);
-            continue;
-        } else if(consume(">=")){
-            node = new_node(ND_LEQ, parse_add(), node);
-            // print_tree(node, 0);
-            continue;
+// スタックの一番上の演算子を被演算子に適用する
+void reduce(){
+    Opr* opr = &oprs[--opr_len];
+    Node* node;
+    if (opr->kind == OPR_BINARY){
+        Node* rhs = vals[--val_len];
+        Node* lhs = vals[--val_len];
+        node = new_node_binary(opr->op, lhs, rhs);
+    } else {
+        Node* operand = vals[--val_len];
+        node = new_node_prefix(opr->op, operand);
+        if (node == operand){ // 単項+ は新しいノードを作らないので位置もそのまま
+            push_val(node);
+            return;
         }
-        return node;
     }
+    node->loc = opr->loc;
+    push_val(node);
 }
 
-
-Node* parse_add(){
-    // fprintf(stderr, "parse_add called\n");
-    Node* node = parse_mul();
-
-    for(;;){
-        if(consume("+")){
-            node = new_node(ND_ADD, node, parse_mul());
-            // print_tree(node, 0);
-            continue;
-        } else if(consume("-")){
-            node = new_node(ND_SUB, node, parse_mul());
-            // print_tree(node, 0);
-            continue;
+int consume_op(char** ops){
+    for (int i=0; ops[i]; i++){
+        if (consume(ops[i])){
+            return i;
         }
-        return node;
     }
+    return -1;
 }
 
-Node* parse_mul(){
-    // fprintf(stderr, "parse_mul called\n");
-    Node* node = parse_unary();
+Node* parse_expr(){
+    // fprintf(stderr, "parse_expr called\n");
+    int opr_base = opr_len;
+    int val_base = val_len;
 
     for(;;){
-        if(consume("*")){
-            node = new_node(ND_MUL, node, parse_unary());
-            // print_tree(node, 0);
+        // 被演算子の位置: 前置演算子と "(" はスタックに積んで読み進める
+        char* loc = token->str;
+        if (consume("(")){
+            push_opr(OPR_PAREN, "(", 0, loc);
             continue;
-        } else if(consume("/")){
-            node = new_node(ND_DIV, node, parse_unary());
-            // print_tree(node, 0);
+        }
+        int prefix = consume_op(prefix_ops);
+        if (prefix >= 0){
+            push_opr(OPR_PREFIX, prefix_ops[prefix], 0, loc);
             continue;
         }
-        return node;
-    }
-}
-
-Node* parse_unary(){
-    // fprintf(stderr, "parse_unary called\n");
-    Node* node;
-    if(consume("+")){
-        node = parse_primary();
-        // print_tree(node, 0);
-    } else if(consume("-")){
-        node = new_node_num(0);
-        node = new_node(ND_SUB, node, parse_primary());
-        // print_tree(node, 0);
-    } else {
-        node = parse_primary();
+        push_val(parse_primary());
+
+        // 演算子の位置
+        for(;;){
+            loc = token->str;
+            if (consume("[")){
+                push_opr(OPR_INDEX, "[", 0, loc);
+                break;
+            }
+
+            int prec = 0;
+            char* op = NULL;
+            for (int i=0; binary_ops[i].op; i++){
+                if (consume(binary_ops[i].op)){
+                    op = binary_ops[i].op;
+                    prec = binary_ops[i].prec;
+                    break;
+                }
+            }
+            if (op){
+                // 前置演算子と、より強く結合する(同じ強さで左結合の)演算子を先に畳む
+                while (opr_len > opr_base &&
+                       (oprs[opr_len-1].kind == OPR_PREFIX ||
+                        (oprs[opr_len-1].kind == OPR_BINARY &&
+                         (oprs[opr_len-1].prec > prec || (oprs[opr_len-1].prec == prec && prec != PREC_ASSIGN))))){
+                    reduce();
+                }
+                push_opr(OPR_BINARY, op, prec, loc);
+                break;
+            }
+
+            // 式の区切りなので、直近の括弧の中をすべて畳む
+            while (opr_len > opr_base && (oprs[opr_len-1].kind == OPR_BINARY || oprs[opr_len-1].kind == OPR_PREFIX)){
+                reduce();
+            }
+            if (opr_len == opr_base){
+                Node* node = vals[--val_len];
+                if (val_len != val_base){
+                    error_at(token->str, "invalid expression\n");
+                }
+                return node;
+            }
+            if (oprs[opr_len-1].kind == OPR_PAREN){
+                expect(")");
+                opr_len--;
+            } else {
+                expect("]");
+                opr_len--;
+                // a[i] は *(a+i) と同じ
+                Node* idx = vals[--val_len];
+                Node* base = vals[--val_len];
+                Node* node = new_node_deref(new_node_add(base, idx));
+                node->loc = oprs[opr_len].loc;
+                push_val(node);
+            }
+        }
     }
-    return node;
 }
 
 Node* parse_primary(){
     // fprintf(stderr, "parse_primary called\n");
     Node* node;
+    char* loc = token->str;
     Token* tok = consume_ident();
 
-    if(consume("(")){
-        node = parse_expr();
-        expect(")");
-    } else if(tok){
+    if(tok){
         node = new_node_ident(tok);
     } else {
         int num = expect_number();
         node = new_node_num(num);
         // print_tree(node, 0);
     }
+    node->loc = loc;
     return node;
 }
 
-
 // 読み込む関数
 int consume_type(TokenKind kind){
     if (token->kind != kind){
@@ -0,0 +1,190 @@
+#include "compiler.h"
+
+// 分岐の実行回数を使った最適化(PGO)
+// --profile-generate では if/while/for ごとに2つのカウンタを置き、終了時にファイルへ書き出す
+//   if: [0] then節に入った回数 [1] .Lelse に飛んだ回数
+//   ループ: [0] .Lbegin を通った回数 [1] .Lend に出た回数
+// --profile-use ではその回数を読み、if の並べ方とループの展開を決める
+//
+// ファイルの形式(テキスト):
+//   sites N
+//   番号 カウンタ0 カウンタ1   (N行)
+
+int branch_num = 0; // カウンタを置く分岐の数(構文解析の順に番号を振る)
+char* profile_generate = NULL; // 書き出すファイル(NULLなら計測しない)
+long* profile_counts = NULL; // 読み込んだ回数(NULLならプロファイルなし)
+
+// 飛び先の節がこの割合(%)未満しか実行されなければ冷たいとみなし、関数の後ろへ追い出す
+#define PROFILE_COLD_PERCENT 1
+// ループの先頭をこの回数以上通り、1回に入るごとにPROFILE_UNROLL周以上回るなら展開する
+#define PROFILE_HOT_COUNT 1000
+#define PROFILE_UNROLL 4
+
+void read_profile(char* path){
+    FILE* fp = fopen(path, "r");
+    if (!fp){
+        error("cannot open profile %s\n", path);
+    }
+    int n;
+    if (fscanf(fp, "sites %d", &n) != 1 || n != branch_num){
+        error("profile %s does not match the program\n", path);
+    }
+    profile_counts = (long*)calloc(n * 2 + 1, sizeof(long));
+    for (int i=0; i<n; i++){
+        int id;
+        long c0, c1;
+        if (fscanf(fp, "%d %ld %ld", &id, &c0, &c1) != 3 || id != i){
+            error("broken profile %s\n", path);
+        }
+        profile_counts[i*2] = c0;
+        profile_counts[i*2+1] = c1;
+    }
+    fclose(fp);
+}
+
+// ifのelse側の方が多く実行されていれば、else側を真っすぐ実行しthen節へ飛ぶ並べ方にする
+int profile_swap_if(Node* node){
+    if (!profile_counts){
+        return 0;
+    }
+    return profile_counts[node->prof*2+1] > profile_counts[node->prof*2];
+}
+
+// 飛び先になる節がほとんど実行されないか
+int profile_cold_if(Node* node){
+    if (!profile_counts){
+        return 0;
+    }
+    long then_count = profile_counts[node->prof*2];
+    long else_count = profile_counts[node->prof*2+1];
+    long total = then_count + else_count;
+    long jump = then_count < else_count ? then_count : else_count;
+    return total > 0 && jump * 100 < total * PROFILE_COLD_PERCENT;
+}
+
+// 本体に他のループか case/default ラベルを含むか
+// (ラベルは本体を並べた数だけ重複して定義されてしまう)
+int has_loop_or_case(Node* node){
+    Node** stack = (Node**)malloc(sizeof(Node*) * 16);
+    int cap = 16;
+    int len = 0;
+    int found = 0;
+    stack[len++] = node;
+    while (len > 0 && !found){
+        Node* cur = stack[--len];
+        if (cur->kind == ND_WHILE || cur->kind == ND_FOR || cur->kind == ND_CASE){
+            found = 1;
+        }
+        if (len + 3 > cap){
+            cap *= 2;
+            stack = (Node**)realloc(stack, sizeof(Node*) * cap);
+        }
+        if (cur->lhs){
+            stack[len++] = cur->lhs;
+        }
+        if (cur->rhs){
+            stack[len++] = cur->rhs;
+        }
+        if (cur->kind == ND_BLOCK && cur->next){
+            stack[len++] = cur->next;
+        }
+    }
+    free(stack);
+    return found;
+}
+
+// ループ本体を何回分並べるか(展開しなければ1)
+// 一番内側の熱いループだけを展開し、コードが掛け算で膨らまないようにする
+int profile_unroll(Node* node){
+    if (!profile_counts || node->vec){
+        return 1;
+    }
+    long begin = profile_counts[node->prof*2];
+    long end = profile_counts[node->prof*2+1];
+    if (begin < PROFILE_HOT_COUNT){
+        return 1;
+    }
+    if (end > 0 && (begin - end) / end < PROFILE_UNROLL){
+        return 1;
+    }
+    if (has_loop_or_case(node->rhs)){
+        return 1;
+    }
+    return PROFILE_UNROLL;
+}
+
+// カウンタ counter (分岐 id の 0 か 1) を増やす
+void gen_prof_inc(Node* node, int counter){
+    printf("\tinc qword ptr .Lprof+%d[rip]\n", (node->prof * 2 + counter) * 8);
+}
+
+// プロローグで呼ぶ: 終了時にカウンタを書き出すよう登録する(rspが16バイト境界のときに呼ぶ)
+void gen_prof_init(){
+    printf("\tlea rdi, .Lprof_dump[rip]\n");
+    printf("\tcall atexit@PLT\n");
+}
+
+// カウンタの領域と、それをファイルへ書き出す関数
+// (ユーザのコードではないので、-g でも main. のシンボルは付けない)
+void gen_prof_data(){
+    gen_loc_none();
+    printf(".Lprof_dump:\n");
+    printf("\tpush rbx\n");
+    printf("\tpush r12\n");
+    printf("\tsub rsp, 8\n"); // 呼び出し時にrspを16バイト境界にそろえる
+    printf("\tlea rdi, .Lprof_path[rip]\n");
+    printf("\tlea rsi, .Lprof_mode[rip]\n");
+    printf("\tcall fopen@PLT\n");
+    printf("\ttest rax, rax\n");
+    printf("\tje .Lprof_done\n");
+    printf("\tmov rbx, rax\n");
+    printf("\tmov rdi, rbx\n");
+    printf("\tlea rsi, .Lprof_head[rip]\n");
+    printf("\tmov edx, %d\n", branch_num);
+    printf("\txor eax, eax\n");
+    printf("\tcall fprintf@PLT\n");
+    printf("\txor r12d, r12d\n");
+    printf(".Lprof_loop:\n");
+    printf("\tcmp r12, %d\n", branch_num);
+    printf("\tjge .Lprof_close\n");
+    printf("\tmov rdi, rbx\n");
+    printf("\tlea rsi, .Lprof_line[rip]\n");
+    printf("\tmov rdx, r12\n");
+    printf("\tmov rax, r12\n");
+    printf("\tshl rax, 4\n");
+    printf("\tlea r8, .Lprof[rip]\n");
+    printf("\tmov rcx, [r8+rax]\n");
+    printf("\tmov r8, [r8+rax+8]\n");
+    printf("\txor eax, eax\n");
+    printf("\tcall fprintf@PLT\n");
+    printf("\tinc r12\n");
+    printf("\tjmp .Lprof_loop\n");
+    printf(".Lprof_close:\n");
+    printf("\tmov rdi, rbx\n");
+    printf("\tcall fclose@PLT\n");
+    printf(".Lprof_done:\n");
+    printf("\tadd rsp, 8\n");
+    printf("\tpop r12\n");
+    printf("\tpop rbx\n");
+    printf("\tret\n");
+
+    printf(".section .rodata\n");
+    printf(".Lprof_path:\n");
+    printf("\t.byte ");
+    for (char* p = profile_generate; *p; p++){ // パスに引用符などがあってもよいように数値で置く
+        printf("%d,", (unsigned char)*p);
+    }
+    printf("0\n");
+    printf(".Lprof_mode:\n");
+    printf("\t.string \"w\"\n");
+    printf(".Lprof_head:\n");
+    printf("\t.string \"sites %%d\\n\"\n");
+    printf(".Lprof_line:\n");
+    printf("\t.string \"%%ld %%ld %%ld\\n\"\n");
+
+    printf(".bss\n");
+    printf(".balign 8\n");
+    printf(".Lprof:\n");
+    printf("\t.zero %d\n", branch_num * 16);
+    printf(".text\n");
+}
@@ -0,0 +1,99 @@
+#!/bin/bash
+# 深さ10^6まで入れ子になった式でスタックがあふれず、深さに比例した時間で終わるか
+# case の多い switch と長い else if の連なりも、大きさに比例した時間で終わるか
+N=1000000
+
+# gen パターン 深さ: 入力を tmp.in に作る
+gen(){
+    awk -v p="$1" -v n="$2" 'BEGIN {
+        if (p == "paren") {
+            for (i = 0; i < n; i++) printf "(";
+            printf "1";
+            for (i = 0; i < n; i++) printf ")";
+        } else if (p == "left") {
+            printf "1";
+            for (i = 1; i < n; i++) printf "+1";
+        } else if (p == "assign") {
+            for (i = 0; i < n; i++) printf "a=";
+            printf "7";
+        } else if (p == "unary") {
+            for (i = 0; i < n; i++) printf "- ";
+            printf "1";
+        } else if (p == "deref") {
+            printf "int x; x=5; ";
+            for (i = 0; i < n; i++) printf "*&";
+            printf "x";
+        } else if (p == "switch") {
+            printf "x=3; r=0; switch(x){";
+            for (i = 0; i < n; i++) printf "case %d: r=%d; break; ", i, i % 200;
+            printf "} return r";
+        } else if (p == "sparse") {
+            printf "x=3000; r=0; switch(x){";
+            for (i = 0; i < n; i++) printf "case %d: r=%d; break; ", i * 1000, i % 200;
+            printf "} return r";
+        } else if (p == "elseif") {
+            printf "x=3; r=0; ";
+            for (i = 0; i < n; i++) printf "if(x==%d) r=%d; else ", i, i % 200;
+            printf "r=1; return r";
+        }
+        printf ";\n";
+    }' > tmp.in
+}
+
+# コンパイル(アセンブリ出力)と--interpにかかった秒数を elapsed に入れる
+measure(){
+    start=$(date +%s.%N)
+    ./compiler - < tmp.in > tmp.s || exit 1
+    ./compiler --interp - < tmp.in
+    actual="$?"
+    end=$(date +%s.%N)
+    elapsed=$(awk -v s="$start" -v e="$end" 'BEGIN { printf "%.3f", e - s }')
+}
+
+# stress パターン 期待値 ネイティブでも実行するか [大きさ(省略時はN)]
+stress(){
+    pattern="$1"
+    expected="$2"
+    size="${4:-$N}"
+
+    gen "$pattern" $((size / 10))
+    measure
+    small="$elapsed"
+    gen "$pattern" "$size"
+    measure
+    large="$elapsed"
+    if [ "$actual" != "$expected" ]; then
+        echo "$pattern: $expected expected, but got $actual by --interp"
+        exit 1
+    fi
+
+    # 生成したコード自体も深さの分だけスタックを使うものは実行しない
+    if [ "$3" = "native" ]; then
+        cc -o tmp tmp.s 2>/dev/null
+        ./tmp
+        actual="$?"
+        if [ "$actual" != "$expected" ]; then
+            echo "$pattern: $expected expected, but got $actual by native"
+            exit 1
+        fi
+    fi
+
+    echo "$pattern: size $((size / 10)) ${small}s, size $size ${large}s"
+    # 線形なら10倍程度になるはず(計測の揺れを見込んで余裕を持たせる)
+    if awk -v s="$small" -v l="$large" 'BEGIN { exit !(l > 30 * s + 0.5) }'; then
+        echo "$pattern: not linear"
+        exit 1
+    fi
+}
+
+stress paren 1 native
+stress left $((N % 256)) native
+stress assign 7
+stress unary 1
+stress deref 5
+# 文の入れ子は再帰で処理するので、else if の連なりは浅めにする
+stress switch 3 native $((N / 10))
+stress sparse 3 native $((N / 10))
+stress elseif 3 native $((N / 20))
+
+echo passed!!
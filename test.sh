@@ -15,8 +15,114 @@ assert(){
         echo "$input => $expected expected, but got $actual"
         exit 1
     fi
+
+    # インタプリタの結果がネイティブと一致するか
+    ./compiler --interp "$input"
+    interp="$?"
+    if [ "$interp" != "$actual" ]; then
+        echo "$input => $actual by native, but got $interp by --interp"
+        exit 1
+    fi
 }
 
+# 計測したプログラムと、その回数で並べ直したプログラムの結果がどちらも正しいか
+assert_profile(){
+    expected="$1"
+    input="$2"
+
+    rm -f tmp.prof
+    ./compiler --profile-generate=tmp.prof "$input" > tmp.s
+    cc -o tmp tmp.s
+    ./tmp
+    actual="$?"
+    if [ "$actual" != "$expected" ] || [ ! -f tmp.prof ]; then
+        echo "$input => $expected expected, but got $actual with --profile-generate"
+        exit 1
+    fi
+
+    ./compiler --profile-use=tmp.prof "$input" > tmp.s
+    cc -o tmp tmp.s
+    ./tmp
+    actual="$?"
+    if [ "$actual" != "$expected" ]; then
+        echo "$input => $expected expected, but got $actual with --profile-use"
+        exit 1
+    fi
+    echo "$input => $actual (profile)"
+}
+
+# -g でも結果が同じで、ラベルのシンボルが addr2line で期待したソースの行に当たるか
+assert_debug(){
+    expected="$1"
+    label="$2"
+    line="$3"
+    input="$4"
+
+    ./compiler -g --source-name=debug.c "$input" > tmp.s
+    cc -o tmp tmp.s
+    ./tmp
+    actual="$?"
+    if [ "$actual" != "$expected" ]; then
+        echo "$input => $expected expected, but got $actual with -g"
+        exit 1
+    fi
+    addr=$(nm tmp | awk -v name="main.$label" '$3 == name {print $1}')
+    where=$(addr2line -e tmp "0x$addr")
+    case "$where" in
+        *debug.c:$line) ;;
+        *)
+            echo "$input => main.$label at debug.c:$line expected, but got $where"
+            exit 1;;
+    esac
+    echo "$input => $actual (main.$label at $where)"
+}
+
+# switchの下ろし方: ジャンプテーブル(.Lswt)と二分探索の分かれ目(.Lswl)の数と、結果を確かめる
+assert_switch(){
+    expected="$1"
+    tables="$2"
+    trees="$3"
+    option="$4"
+    input="$5"
+
+    ./compiler $option "$input" > tmp.s
+    actual_tables=$(grep -c '^\.Lswt[0-9]*:' tmp.s)
+    actual_trees=$(grep -c '^\.Lswl[0-9]*:' tmp.s)
+    if [ "$actual_tables" != "$tables" ] || [ "$actual_trees" != "$trees" ]; then
+        echo "$input => $tables tables and $trees tree nodes expected, but got $actual_tables and $actual_trees with '$option'"
+        exit 1
+    fi
+    cc -o tmp tmp.s
+    ./tmp
+    actual="$?"
+    if [ "$actual" != "$expected" ]; then
+        echo "$input => $expected expected, but got $actual with '$option'"
+        exit 1
+    fi
+    echo "$input => $actual ($tables tables, $trees tree nodes $option)"
+}
+
+# GVN(--stats)が消した式の数を確かめる
+assert_gvn(){
+    expected="$1"
+    input="$2"
+
+    actual=$(./compiler --stats "$input" 2>&1 >/dev/null | sed -n 's/^gvn: \([0-9]*\) expressions eliminated$/\1/p')
+    if [ "$actual" != "$expected" ]; then
+        echo "$input => $expected expressions eliminated expected, but got $actual"
+        exit 1
+    fi
+    echo "$input => $actual eliminated"
+}
+
+# 呼んでいるのに定義されていない assert* があれば、確かめずに通ってしまうので止める
+for helper in $(grep -o '^assert[a-z_]*' "$0" | sort -u); do
+    if ! declare -F "$helper" > /dev/null; then
+        echo "$helper is not defined"
+        exit 1
+    fi
+done
+
 assert 10 "10;"
 assert 13 "(1+2)*3+4;"
 assert 0 "(1==3)+4*2<5;"
@@ -33,5 +139,66 @@ assert 2 "{1;2;}"
 assert 1 "if(1){10;20;} return 1;"
 assert 1 "if(1){} return 1;"
 assert 3 "foo=10; cnt=0; while(foo>3){foo=foo-3; cnt=cnt+1;} return cnt;"
+assert 3 "int x; int *p; p = &x; *p = 3; return x;"
+assert 5 "int a[4]; *(a+1) = 5; return a[1];"
+assert 7 "int a[4]; int *p; p = a; p[3] = 7; return *(p+3);"
+assert 3 "int a[8]; int *p; int *q; p = a + 1; q = &a[4]; return q - p;"
+assert 12 "int a[2][3]; a[1][2] = 12; return a[1][2];"
+assert 0 "if (0) 5; "
+assert 148 "int a[100]; int b[100]; int c[100]; n=100; for(i=0; i<n; i=i+1){b[i]=i; c[i]=2*i;} for(i=0; i<n; i=i+1) a[i]=b[i]+c[i]; s=0; for(i=0; i<n; i=i+1) s=s+a[i]; return s/100;"
+assert 13 "int a[13]; int b[13]; for(i=0; i<13; i=i+1) b[i]=i; for(i=0; i<13; i=i+1) a[i]=b[i]*2-b[i]+1; return a[12];"
+assert 7 "int a[9]; int b[9]; int c[9]; for(i=0; i<9; i=i+1){b[i]=100000+i; c[i]=300000;} big=100000*300000; for(i=0; i<9; i=i+1) a[i]=b[i]*c[i]-big; return a[7]/300000;"
+assert 239 "int a[31]; int b[31]; for(i=0; i<31; i=i+1){a[i]=i; b[i]=1;} k=2; s=0; for(i=1; i<31; i=i+1) s=a[i]*b[i]*k+s; return s/4+7;"
+assert 31 "int a[31]; n=31; for(i=0; i<n; i=i+1) a[i]=0; return i;"
+assert 7 "x=3; switch(x){case 1: return 5; case 3: return 7; default: return 9;}"
+assert 9 "x=4; switch(x){case 1: return 5; case 3: return 7; default: return 9;}"
+assert 2 "r=0; x=2; switch(x){case 1: r=r+1; case 2: r=r+1; case 3: r=r+1; break; case 4: r=r+10;} return r;"
+assert 0 "r=0; x=9; switch(x){case 1: r=1; break; case 2: r=2; break;} return r;"
+assert 58 "s=0; for(i=0; i<10; i=i+1){ switch(i){case 0: case 1: case 2: case 3: s=s+1; break; case 4: s=s+2; break; case 5: s=s+3; break; case 6: s=s+4; break; case 7: s=s+5; break; default: s=s+20;} } return s;"
+assert 44 "s=0; for(i=0; i<20; i=i+1){ switch(i*100){case 0: s=s+1; break; case 300: s=s+2; break; case 900: s=s+3; break; case 1700: s=s+4; break; case 1800: s=s+5; break; case 1900: s=s+29; break;} } return s;"
+assert 18 "s=0; for(i=-3; i<40; i=i+1){ switch(i){case -2: s=s+1; break; case 0: case 1: case 2: case 3: case 4: s=s+2; break; case 30: s=s+3; break; case 31: case 32: case 33: case 35: s=s+1; break; case 1000: s=100;} } return s;"
+assert_switch 4 1 0 "" "x=3; switch(x){case 0: x=1; break; case 1: x=2; break; case 2: x=3; break; case 3: x=4; break; case 4: x=5; break; case 5: x=6;} return x;"
+assert_switch 3 0 4 "" "x=1000; switch(x){case 1: x=1; break; case 100: x=2; break; case 1000: x=3; break; case 10000: x=4; break; case 100000: x=5;} return x;"
+assert_switch 6 1 2 "" "x=2000; switch(x){case 0: x=1; break; case 1: x=2; break; case 2: x=3; break; case 3: x=4; break; case 1000: x=5; break; case 2000: x=6;} return x;"
+assert_switch 4 1 0 "" "x=6; switch(x){case 0: x=1; break; case 2: x=2; break; case 4: x=3; break; case 6: x=4; break; case 8: x=5;} return x;"
+assert_switch 4 0 4 "--switch-density=100" "x=6; switch(x){case 0: x=1; break; case 2: x=2; break; case 4: x=3; break; case 6: x=4; break; case 8: x=5;} return x;"
+assert 5 "i=0; while(1){ i=i+1; if(i==5) break; } return i;"
+assert 12 "s=0; for(i=0; i<4; i=i+1){ for(j=0; j<10; j=j+1){ if(j==3) break; s=s+1; } } return s;"
+assert 2 "x=1; y=2; switch(x){case 1: switch(y){case 2: x=2; break; default: x=3;} break; case 2: x=4;} return x;"
+assert_gvn 2 "a*b+a*b+a*b;"
+assert_gvn 3 "x=a*b; y=a*b+a*b+a*b;"
+assert_gvn 1 "a=3; b=4; return (a+b)*(a+b);"
+assert_gvn 0 "a=1; b=2; c=a+b; a=5; d=a+b; return c*10+d;"
+assert_gvn 0 "x=2; y=3; if(x<y) z=x*y; else z=0; w=x*y; return z+w;"
+assert_gvn 2 "x=2; y=3; w=x*y; if(w) x=x*y; else y=x*y; return x*y+w;"
+assert_gvn 1 "s=0; x=2; y=3; t=x*y; i=0; while(i<3){s=s+x*y; i=i+1;} return s+t;"
+assert_gvn 0 "s=0; x=2; y=3; t=x*y; i=0; while(i<3){s=s+x*y; y=y+1; i=i+1;} return s+t+x*y;"
+assert_gvn 0 "a=3; b=4; int *p; p=&a; c=a+b; *p=10; return c+(a+b);"
+assert_gvn 1 "x=4; y=x; return (x+1)*(y+1);"
+assert 49 "a=3; b=4; return (a+b)*(a+b);"
+assert 37 "a=1; b=2; c=a+b; a=5; d=a+b; return c*10+d;"
+assert 24 "x=2; y=3; w=x*y; if(w) x=x*y; else y=x*y; return x*y+w;"
+assert 42 "s=0; x=2; y=3; t=x*y; i=0; while(i<3){s=s+x*y; y=y+1; i=i+1;} return s+t+x*y;"
+assert 49 "a=5; b=7; switch(a){case 5: c=a*b; case 6: a=1; c=c+a*b; break; default: c=a*b;} return c+a*b;"
+assert 21 "a=3; b=4; int *p; p=&a; c=a+b; *p=10; return c+(a+b);"
+assert 25 "x=4; y=x; return (x+1)*(y+1);"
+assert_profile 200 "n=0; c=0; while(n<3000){ if(n/3*3==n) c=c+1; else if(n==7) c=c+100; n=n+1; } return c-900;"
+assert_profile 208 "s=0; for(i=0; i<5000; i=i+1){ if(i==4999) return s/1000+i/1000; s=s+i; } return 1;"
+assert_profile 4 "s=0; for(i=0; i<3; i=i+1){ for(j=0; j<2000; j=j+1){ if(j==1500) break; } s=s+j/500; } return s/2;"
+assert_profile 50 "n=0; x=1; switch(x){ case 0: while(n<5000){ case 1: n=n+1; } } return n/100;"
+assert_debug 55 begin0 2 "s=0;
+for(i=1; i<=10; i=i+1)
+  s=s+i;
+return s;"
+assert_debug 16 vecavx2 3 "int a[8]; int b[8];
+for(i=0; i<8; i=i+1) b[i]=i;
+for(i=0; i<8; i=i+1) a[i]=b[i]*2;
+if(a[7]==14) return a[7]+a[1]; else return 0;"
+assert_debug 15 else0 5 "x=3;
+if(x==2)
+  x=1;
+else
+  x=x*5;
+return x;"
 
 echo passed!!
\ No newline at end of file
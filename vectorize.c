@@ -0,0 +1,390 @@
+#include "compiler.h"
+
+// 単純な回数ループの自動ベクトル化
+//   for (i = ...; i < n; i = i + 1) a[i] = 式;      (要素ごとの演算)
+//   for (i = ...; i < n; i = i + 1) s = s + 式;     (総和の縮約)
+// 式は b[i] (int配列の要素)、ループ中で変わらない変数、数値の + - * だけからなるもの。
+// 配列はローカル変数なので互いに重ならず、添字がすべて i なので反復間の依存はない。
+// 実行時にCPUIDでAVX2(4要素)かSSE2(2要素)を選び、端数は元のスカラーループで処理する。
+
+struct VecLoop {
+    int ivar; // ループ変数のオフセット
+    int nvar; // 上限の変数のオフセット(0なら nval の定数)
+    int nval;
+    Node* dst; // a[i] = ... なら代入先の配列、総和なら NULL
+    int svar; // 総和を足し込む変数のオフセット
+    Node* expr;
+    Node* invs[13]; // ループの前に一度だけ全レーンに広げておく数値と変数
+    int ninv; // invs[k] は xmm(VEC_NREGS-1-k) に置く
+};
+
+#define VEC_NREGS 13 // xmm0〜xmm12 を式の計算と不変な値に使う
+#define VEC_ACC 13 // 総和用のアキュムレータ
+#define VEC_TMP1 14 // 64bit乗算の作業用
+#define VEC_TMP2 15
+#define VEC_MAX_DEPTH 64 // これより深い式は(再帰で調べないよう)ベクトル化しない
+
+int vectorized = 0;
+
+int is_int_var(Node* node){
+    return node->kind == ND_LVAR && node->ty->kind == TY_INT;
+}
+
+// *(a + i*8) の形で、a がint配列なら a を返す
+Node* elem_array(Node* node, int ivar){
+    if (node->kind != ND_DEREF || node->lhs->kind != ND_ADD){
+        return NULL;
+    }
+    Node* base = node->lhs->lhs;
+    Node* idx = node->lhs->rhs;
+    if (base->kind != ND_LVAR || base->ty->kind != TY_ARRAY || base->ty->ptr_to->kind != TY_INT){
+        return NULL;
+    }
+    if (idx->kind != ND_MUL || !is_int_var(idx->lhs) || idx->lhs->offset != ivar ||
+        idx->rhs->kind != ND_NUM || idx->rhs->val != 8){
+        return NULL;
+    }
+    return base;
+}
+
+// ベクトルレジスタで計算できる式なら必要なレジスタ数、できなければ0を返す
+// skip は式の中に現れてはいけない変数(ループ変数・総和の変数)
+int vec_regs(Node* node, int ivar, int skip, int depth){
+    if (depth > VEC_MAX_DEPTH){
+        return 0;
+    }
+    if (node->kind == ND_NUM || elem_array(node, ivar)){
+        return 1;
+    }
+    if (is_int_var(node)){
+        return (node->offset == ivar || node->offset == skip) ? 0 : 1;
+    }
+    if (node->kind != ND_ADD && node->kind != ND_SUB && node->kind != ND_MUL){
+        return 0;
+    }
+    if (node->ty->kind != TY_INT){ // ポインタ演算は対象外
+        return 0;
+    }
+    int l = vec_regs(node->lhs, ivar, skip, depth+1);
+    int r = vec_regs(node->rhs, ivar, skip, depth+1);
+    if (!l || !r){
+        return 0;
+    }
+    return (l > r + 1) ? l : r + 1; // 左を先に計算して1本保持したまま右を計算する
+}
+
+// 不変な値(数値・変数)のレジスタ番号、まだ割り当てていなければ-1
+int inv_reg(VecLoop* vec, Node* node){
+    for (int k=0; k<vec->ninv; k++){
+        Node* inv = vec->invs[k];
+        if (inv->kind == node->kind && (node->kind == ND_NUM ? inv->val == node->val : inv->offset == node->offset)){
+            return VEC_NREGS - 1 - k;
+        }
+    }
+    return -1;
+}
+
+// 式の中の不変な値を集める(式の深さは vec_regs で確かめてある)
+// 多すぎてレジスタに収まらなければ0を返す
+int collect_invs(VecLoop* vec, Node* node){
+    if (elem_array(node, vec->ivar)){
+        return 1;
+    }
+    if (node->kind == ND_NUM || node->kind == ND_LVAR){
+        if (inv_reg(vec, node) < 0){
+            if (vec->ninv == VEC_NREGS){
+                return 0;
+            }
+            vec->invs[vec->ninv++] = node;
+        }
+        return 1;
+    }
+    return collect_invs(vec, node->lhs) && collect_invs(vec, node->rhs);
+}
+
+VecLoop* analyze_loop(Node* node){
+    Node* cond = node->lhs->lhs->rhs;
+    Node* inc = node->lhs->rhs;
+    Node* body = node->rhs;
+
+    // 条件 i < n
+    if (!cond || cond->kind != ND_LT || !is_int_var(cond->lhs)){
+        return NULL;
+    }
+    int ivar = cond->lhs->offset;
+    VecLoop* vec = (VecLoop*)calloc(1, sizeof(VecLoop));
+    vec->ivar = ivar;
+    if (cond->rhs->kind == ND_NUM){
+        vec->nval = cond->rhs->val;
+    } else if (is_int_var(cond->rhs) && cond->rhs->offset != ivar){
+        vec->nvar = cond->rhs->offset;
+    } else {
+        return NULL;
+    }
+
+    // 更新 i = i + 1
+    if (!inc || inc->kind != ND_ASSIGN || !is_int_var(inc->lhs) || inc->lhs->offset != ivar ||
+        inc->rhs->kind != ND_ADD || !is_int_var(inc->rhs->lhs) || inc->rhs->lhs->offset != ivar ||
+        inc->rhs->rhs->kind != ND_NUM || inc->rhs->rhs->val != 1){
+        return NULL;
+    }
+
+    // 本体は代入文1つ
+    if (body->kind == ND_BLOCK){
+        if (!body->lhs || body->next){
+            return NULL;
+        }
+        body = body->lhs;
+    }
+    if (body->kind != ND_ASSIGN){
+        return NULL;
+    }
+
+    if (elem_array(body->lhs, ivar)){
+        vec->dst = elem_array(body->lhs, ivar);
+        vec->expr = body->rhs;
+        if (vec_regs(vec->expr, ivar, 0, 0) == 0){
+            return NULL;
+        }
+    } else if (is_int_var(body->lhs)){
+        int svar = body->lhs->offset;
+        Node* rhs = body->rhs;
+        if (svar == ivar || svar == vec->nvar || rhs->kind != ND_ADD){
+            return NULL;
+        }
+        if (is_int_var(rhs->lhs) && rhs->lhs->offset == svar){
+            vec->expr = rhs->rhs;
+        } else if (is_int_var(rhs->rhs) && rhs->rhs->offset == svar){
+            vec->expr = rhs->lhs;
+        } else {
+            return NULL;
+        }
+        vec->svar = svar;
+        if (vec_regs(vec->expr, ivar, svar, 0) == 0){
+            return NULL;
+        }
+    } else {
+        return NULL;
+    }
+
+    // 式の計算に使うレジスタと、不変な値を置くレジスタが重ならないこと
+    if (!collect_invs(vec, vec->expr) || vec_regs(vec->expr, ivar, 0, 0) + vec->ninv > VEC_NREGS){
+        return NULL;
+    }
+    return vec;
+}
+
+void vectorize_node(Node* node){
+    while (node){
+        if (node->kind == ND_FOR){
+            node->vec = analyze_loop(node);
+            if (node->vec){
+                vectorized++;
+            }
+            vectorize_node(node->rhs);
+        } else if (node->kind == ND_WHILE || node->kind == ND_SWITCH){
+            vectorize_node(node->rhs);
+        } else if (node->kind == ND_CASE){
+            node = node->lhs;
+            continue;
+        } else if (node->kind == ND_IF){
+            vectorize_node(node->lhs->rhs);
+            vectorize_node(node->rhs);
+        } else if (node->kind == ND_BLOCK){
+            vectorize_node(node->lhs);
+            node = node->next;
+            continue;
+        }
+        return;
+    }
+}
+
+void vectorize_program(){
+    for (int i=0; code[i] != NULL; i++){
+        vectorize_node(code[i]);
+    }
+}
+
+
+// コード生成
+// rcx にループ変数、rdx に上限を置き、式はレジスタ番号 reg から順に使う
+void gen_vec_splat(int reg, int avx){
+    if (avx){
+        printf("\tvmovq xmm%d, rax\n", reg);
+        printf("\tvpbroadcastq ymm%d, xmm%d\n", reg, reg);
+    } else {
+        printf("\tmovq xmm%d, rax\n", reg);
+        printf("\tpunpcklqdq xmm%d, xmm%d\n", reg, reg);
+    }
+}
+
+// ループの前で不変な値を全レーンに広げる
+void gen_vec_invs(VecLoop* vec, int avx){
+    for (int k=0; k<vec->ninv; k++){
+        Node* inv = vec->invs[k];
+        if (inv->kind == ND_NUM){
+            printf("\tmov rax, %d\n", inv->val);
+        } else {
+            printf("\tmov rax, [rbp-%d]\n", inv->offset);
+        }
+        gen_vec_splat(VEC_NREGS - 1 - k, avx);
+    }
+}
+
+// 式の値を計算し、値のあるレジスタ番号を返す
+// 配列の要素と演算の結果は reg に置き、不変な値は広げておいたレジスタをそのまま使う
+int gen_vec_expr(VecLoop* vec, Node* node, int reg, int avx){
+    Node* arr = elem_array(node, vec->ivar);
+    if (arr){
+        printf("\t%s %smm%d, [rbp+rcx*8-%d]\n", avx ? "vmovdqu" : "movdqu", avx ? "y" : "x", reg, arr->offset);
+        return reg;
+    } else if (node->kind == ND_NUM || node->kind == ND_LVAR){
+        return inv_reg(vec, node);
+    }
+
+    int l = gen_vec_expr(vec, node->lhs, reg, avx);
+    int b = gen_vec_expr(vec, node->rhs, reg+1, avx);
+
+    int a = reg;
+    if (avx){
+        if (node->kind == ND_ADD){
+            printf("\tvpaddq ymm%d, ymm%d, ymm%d\n", a, l, b);
+        } else if (node->kind == ND_SUB){
+            printf("\tvpsubq ymm%d, ymm%d, ymm%d\n", a, l, b);
+        } else {
+            // 64bit同士の乗算命令はないので32bitの部分積から組み立てる
+            // l*b = lo(l)*lo(b) + ((hi(l)*lo(b) + lo(l)*hi(b)) << 32)
+            printf("\tvpsrlq ymm%d, ymm%d, 32\n", VEC_TMP1, l);
+            printf("\tvpmuludq ymm%d, ymm%d, ymm%d\n", VEC_TMP1, VEC_TMP1, b);
+            printf("\tvpsrlq ymm%d, ymm%d, 32\n", VEC_TMP2, b);
+            printf("\tvpmuludq ymm%d, ymm%d, ymm%d\n", VEC_TMP2, VEC_TMP2, l);
+            printf("\tvpaddq ymm%d, ymm%d, ymm%d\n", VEC_TMP1, VEC_TMP1, VEC_TMP2);
+            printf("\tvpsllq ymm%d, ymm%d, 32\n", VEC_TMP1, VEC_TMP1);
+            printf("\tvpmuludq ymm%d, ymm%d, ymm%d\n", a, l, b);
+            printf("\tvpaddq ymm%d, ymm%d, ymm%d\n", a, a, VEC_TMP1);
+        }
+    } else {
+        if (l != a){ // SSEは2オペランドなので、広げておいた値を壊さないよう写す
+            printf("\tmovdqa xmm%d, xmm%d\n", a, l);
+        }
+        if (node->kind == ND_ADD){
+            printf("\tpaddq xmm%d, xmm%d\n", a, b);
+        } else if (node->kind == ND_SUB){
+            printf("\tpsubq xmm%d, xmm%d\n", a, b);
+        } else {
+            printf("\tmovdqa xmm%d, xmm%d\n", VEC_TMP1, a);
+            printf("\tpsrlq xmm%d, 32\n", VEC_TMP1);
+            printf("\tpmuludq xmm%d, xmm%d\n", VEC_TMP1, b);
+            printf("\tmovdqa xmm%d, xmm%d\n", VEC_TMP2, b);
+            printf("\tpsrlq xmm%d, 32\n", VEC_TMP2);
+            printf("\tpmuludq xmm%d, xmm%d\n", VEC_TMP2, a);
+            printf("\tpaddq xmm%d, xmm%d\n", VEC_TMP1, VEC_TMP2);
+            printf("\tpsllq xmm%d, 32\n", VEC_TMP1);
+            printf("\tpmuludq xmm%d, xmm%d\n", a, b);
+            printf("\tpaddq xmm%d, xmm%d\n", a, VEC_TMP1);
+        }
+    }
+    return a;
+}
+
+void gen_vec_body(VecLoop* vec, int label, char* name, int avx){
+    int width = avx ? 4 : 2;
+
+    if (vec->dst == NULL){
+        if (avx){
+            printf("\tvpxor ymm%d, ymm%d, ymm%d\n", VEC_ACC, VEC_ACC, VEC_ACC);
+        } else {
+            printf("\tpxor xmm%d, xmm%d\n", VEC_ACC, VEC_ACC);
+        }
+    }
+    gen_vec_invs(vec, avx);
+    gen_label("vec%s%d", name, label);
+    printf("\tlea rax, [rcx+%d]\n", width);
+    printf("\tcmp rax, rdx\n");
+    printf("\tjg .Lvec%send%d\n", name, label); // 残りがwidth未満
+    int r = gen_vec_expr(vec, vec->expr, 0, avx);
+    if (vec->dst){
+        printf("\t%s [rbp+rcx*8-%d], %smm%d\n", avx ? "vmovdqu" : "movdqu", vec->dst->offset, avx ? "y" : "x", r);
+    } else {
+        if (avx){
+            printf("\tvpaddq ymm%d, ymm%d, ymm%d\n", VEC_ACC, VEC_ACC, r);
+        } else {
+            printf("\tpaddq xmm%d, xmm%d\n", VEC_ACC, r);
+        }
+    }
+    printf("\tadd rcx, %d\n", width);
+    printf("\tjmp .Lvec%s%d\n", name, label);
+    gen_label("vec%send%d", name, label);
+
+    if (vec->dst == NULL){ // 各レーンの部分和を足し合わせる
+        if (avx){
+            printf("\tvextracti128 xmm0, ymm%d, 1\n", VEC_ACC);
+            printf("\tvpaddq xmm%d, xmm%d, xmm0\n", VEC_ACC, VEC_ACC);
+            printf("\tvpshufd xmm0, xmm%d, 0x4e\n", VEC_ACC);
+            printf("\tvpaddq xmm%d, xmm%d, xmm0\n", VEC_ACC, VEC_ACC);
+            printf("\tvmovq rax, xmm%d\n", VEC_ACC);
+        } else {
+            printf("\tpshufd xmm0, xmm%d, 0x4e\n", VEC_ACC);
+            printf("\tpaddq xmm%d, xmm0\n", VEC_ACC);
+            printf("\tmovq rax, xmm%d\n", VEC_ACC);
+        }
+        printf("\tadd [rbp-%d], rax\n", vec->svar);
+    }
+    if (avx){
+        printf("\tvzeroupper\n"); // SSE命令との混在による遅延を避ける
+    }
+}
+
+void gen_vec_loop(Node* node){
+    VecLoop* vec = node->vec;
+    int label = label_num;
+    label_num++;
+
+    printf("\tmov rcx, [rbp-%d]\n", vec->ivar);
+    if (vec->nvar){
+        printf("\tmov rdx, [rbp-%d]\n", vec->nvar);
+    } else {
+        printf("\tmov rdx, %d\n", vec->nval);
+    }
+    printf("\tcmp byte ptr .Lhas_avx2[rip], 0\n");
+    printf("\tje .Lvecsse%d\n", label);
+    gen_vec_body(vec, label, "avx", 1);
+    printf("\tjmp .Lvecrest%d\n", label);
+    gen_label("vecsse%d", label);
+    gen_vec_body(vec, label, "sseloop", 0);
+    gen_label("vecrest%d", label);
+    printf("\tmov [rbp-%d], rcx\n", vec->ivar); // 端数はスカラーループへ
+}
+
+// AVX2が使えるかを調べて .Lhas_avx2 に記録する(OSがymmレジスタを保存するかも確認)
+void gen_cpu_detect(){
+    printf("\tpush rbx\n"); // cpuidはrbxを壊す
+    printf("\tmov eax, 0\n");
+    printf("\tcpuid\n");
+    printf("\tcmp eax, 7\n");
+    printf("\tjb .Lcpu_done\n");
+    printf("\tmov eax, 1\n");
+    printf("\tcpuid\n");
+    printf("\tand ecx, 0x18000000\n"); // OSXSAVE, AVX
+    printf("\tcmp ecx, 0x18000000\n");
+    printf("\tjne .Lcpu_done\n");
+    printf("\txor ecx, ecx\n");
+    printf("\txgetbv\n");
+    printf("\tand eax, 6\n"); // XMM, YMM の状態
+    printf("\tcmp eax, 6\n");
+    printf("\tjne .Lcpu_done\n");
+    printf("\tmov eax, 7\n");
+    printf("\txor ecx, ecx\n");
+    printf("\tcpuid\n");
+    printf("\ttest ebx, 0x20\n"); // AVX2
+    printf("\tjz .Lcpu_done\n");
+    printf("\tmov byte ptr .Lhas_avx2[rip], 1\n");
+    printf(".Lcpu_done:\n");
+    printf("\tpop rbx\n");
+}
+
+void gen_vec_data(){
+    printf(".data\n");
+    printf(".Lhas_avx2:\n");
+    printf("\t.byte 0\n");
+}